@@ -0,0 +1,149 @@
+/**
+ * Arena allocator
+ *
+ * One big address space reservation per arena, committed as it grows.
+ * Allocations are a pointer bump, and are freed back to an earlier
+ * point with arena_pop_to():
+ *
+ *   struct arena_mark mark = arena_mark (arena);
+ *   u8 *tmp = arena_push (arena, 4096);
+ *   ...
+ *   arena_pop_to (mark);
+ *
+ * Memory is never handed back to the OS before arena_release(), so a
+ * run only does a handful of large allocations no matter how many
+ * files it goes through.
+ */
+
+#define ARENA_ALIGN 16
+#define ARENA_COMMIT_SIZE (1 << 20)
+
+struct arena
+{
+    u8 *base;
+    u64 reserved;
+    u64 committed;
+    u64 used;
+};
+
+struct arena_mark
+{
+    struct arena *arena;
+    u64 used;
+};
+
+#define arena_push_array(ARENA, TYPE, COUNT) \
+    ((TYPE *) arena_push ((ARENA), sizeof (TYPE) * (COUNT)))
+#define arena_push_array_nozero(ARENA, TYPE, COUNT) \
+    ((TYPE *) arena_push_nozero ((ARENA), sizeof (TYPE) * (COUNT)))
+
+static bool
+arena_init (struct arena *arena, u64 reserve)
+{
+    *arena = (struct arena) {0};
+
+    arena->base = os_reserve (reserve);
+    if (arena->base)
+    {
+        arena->reserved = reserve;
+    }
+
+    return arena->base != NULL;
+}
+
+static void
+arena_release (struct arena *arena)
+{
+    if (arena->base)
+    {
+        os_release (arena->base, arena->reserved);
+    }
+
+    *arena = (struct arena) {0};
+}
+
+/* whether size more bytes fit, for inputs that should fail on their own
+ * instead of ending the run */
+static bool
+arena_fits (struct arena *arena, u64 size)
+{
+    u64 start = (arena->used + (ARENA_ALIGN - 1)) & ~(u64) (ARENA_ALIGN - 1);
+
+    return size <= arena->reserved - start;
+}
+
+/* contents are undefined if the memory is being reused after a pop.
+ * Running out of memory ends the run, callers never see NULL */
+static void *
+arena_push_nozero (struct arena *arena, u64 size)
+{
+    u64 start = (arena->used + (ARENA_ALIGN - 1)) & ~(u64) (ARENA_ALIGN - 1);
+    u64 end = start + size;
+
+    if (!arena_fits (arena, size))
+    {
+        fprintf (stderr, "Error: arena out of memory (%llu of %llu bytes used, %llu requested)\n",
+                 (unsigned long long) arena->used, (unsigned long long) arena->reserved,
+                 (unsigned long long) size);
+        exit (1);
+    }
+
+    if (end > arena->committed)
+    {
+        u64 commit = (end + (ARENA_COMMIT_SIZE - 1)) & ~(u64) (ARENA_COMMIT_SIZE - 1);
+        if (commit > arena->reserved)
+        {
+            commit = arena->reserved;
+        }
+
+        if (!os_commit (arena->base + arena->committed, commit - arena->committed))
+        {
+            fprintf (stderr, "Error: Could not commit %llu bytes of memory\n",
+                     (unsigned long long) (commit - arena->committed));
+            exit (1);
+        }
+        arena->committed = commit;
+    }
+
+    arena->used = end;
+
+    return arena->base + start;
+}
+
+static void *
+arena_push (struct arena *arena, u64 size)
+{
+    void *ptr = arena_push_nozero (arena, size);
+
+    memset (ptr, 0, size);
+
+    return ptr;
+}
+
+static struct arena_mark
+arena_mark (struct arena *arena)
+{
+    struct arena_mark mark = { .arena = arena, .used = arena->used };
+
+    return mark;
+}
+
+static void
+arena_pop_to (struct arena_mark mark)
+{
+    ASSERT (mark.used <= mark.arena->used);
+
+    mark.arena->used = mark.used;
+}
+
+/* gives back everything after end, for when the last allocation
+ * was sized for the worst case */
+static void
+arena_trim (struct arena *arena, void *end)
+{
+    u64 used = (u64) ((u8 *) end - arena->base);
+
+    ASSERT (used <= arena->used);
+
+    arena->used = used;
+}
@@ -0,0 +1,199 @@
+/**
+ * Instruction batches
+ *
+ * struct instruction is convenient for decoding one instruction at a
+ * time but it's mostly pointers and padding. For passes over millions
+ * of instructions, a batch keeps each field in its own packed array so
+ * a scan only pulls in the columns it looks at. "Find all writes to
+ * memory" reads one byte per instruction instead of a whole record.
+ *
+ * The input bytes are kept alongside the columns, batch_get() decodes
+ * an instruction again when a full record is needed (e.g. to print it).
+ */
+
+enum inst_flags
+{
+    INST_W          = 1 << 0,
+    INST_D          = 1 << 1,
+    INST_S          = 1 << 2,
+    INST_DISP8      = 1 << 3, // sign-extended 8-bit displacement (MOD = 01)
+    INST_DISP16     = 1 << 4, // 16-bit displacement or direct address
+    INST_READS_MEM  = 1 << 5,
+    INST_WRITES_MEM = 1 << 6,
+};
+
+/* operand kinds, packed two to a byte: dst in the low nibble, src in the high */
+enum operand_kind
+{
+    KIND_NONE,
+    KIND_REGISTER,
+    KIND_MEMORY,
+    KIND_IMMEDIATE,
+    KIND_DIRECT_ADDRESS,
+};
+
+#define BATCH_DST(PACKED) ((PACKED) & 0xF)
+#define BATCH_SRC(PACKED) ((PACKED) >> 4)
+
+struct inst_batch
+{
+    u32 count;
+    u8 *data;     // the input the batch was decoded from
+
+    u32 *offset;  // byte offset of each instruction in data
+    u8 *op;       // enum op_type
+    u8 *len;
+    u8 *flags;    // enum inst_flags
+    u8 *kinds;    // enum operand_kind, dst | src << 4
+    u8 *regs;     // register index (or R/M field for memory), dst | src << 4
+    u16 *disp;
+    u16 *imm;
+};
+
+static u8 batch_kinds[] = {
+    [REGISTER] = KIND_REGISTER,
+    [MEMORY] = KIND_MEMORY,
+    [IMMEDIATE] = KIND_IMMEDIATE,
+    [DIRECT_ADDRESS] = KIND_DIRECT_ADDRESS,
+};
+
+static void
+batch_store (struct inst_batch *batch, u32 n, u32 offset, u8 len, struct instruction *inst)
+{
+    struct operand *dst = &inst->operands[0];
+    struct operand *src = &inst->operands[1];
+    bool dst_mem = dst->mode == MEMORY || dst->mode == DIRECT_ADDRESS;
+    bool src_mem = src->mode == MEMORY || src->mode == DIRECT_ADDRESS;
+    u8 flags = 0;
+
+    flags |= inst->w ? INST_W : 0;
+    flags |= inst->d ? INST_D : 0;
+    flags |= inst->s ? INST_S : 0;
+    if (dst_mem || src_mem)
+    {
+        flags |= (inst->mod == 0b01) ? INST_DISP8 : 0;
+        flags |= (inst->mod == 0b10 || (inst->mod == 0b00 && inst->rm == 0b110)) ? INST_DISP16 : 0;
+    }
+
+    /* mov only writes its destination, add/sub read it as well, cmp
+     * only reads both sides */
+    if (src_mem || (dst_mem && inst->op != OP_MOV))
+    {
+        flags |= INST_READS_MEM;
+    }
+    if (dst_mem && inst->op != OP_CMP)
+    {
+        flags |= INST_WRITES_MEM;
+    }
+
+    batch->offset[n] = offset;
+    batch->op[n] = (u8) inst->op;
+    batch->len[n] = len;
+    batch->flags[n] = flags;
+    batch->kinds[n] = batch_kinds[dst->mode] | (batch_kinds[src->mode] << 4);
+    batch->regs[n] = (dst->index & 0xF) | (src->index << 4);
+    batch->disp[n] = inst->disp;
+    batch->imm[n] = (src->mode == IMMEDIATE) ? src->data : 0;
+}
+
+/* decodes data into a batch on the arena, stopping at the first byte that
+ * can't be decoded. *decoded_len is how far it got */
+static struct inst_batch
+batch_decode (struct arena *arena, u8 *data, int len, int *decoded_len)
+{
+    /* every instruction we decode is at least two bytes, so that bounds
+     * the column sizes. Pages past the end are never touched */
+    u32 capacity = (u32) len / 2 + 1;
+    struct inst_batch batch = { .data = data };
+    int i = 0;
+
+    batch.offset = arena_push_array_nozero (arena, u32, capacity);
+    batch.op     = arena_push_array_nozero (arena, u8, capacity);
+    batch.len    = arena_push_array_nozero (arena, u8, capacity);
+    batch.flags  = arena_push_array_nozero (arena, u8, capacity);
+    batch.kinds  = arena_push_array_nozero (arena, u8, capacity);
+    batch.regs   = arena_push_array_nozero (arena, u8, capacity);
+    batch.disp   = arena_push_array_nozero (arena, u16, capacity);
+    batch.imm    = arena_push_array_nozero (arena, u16, capacity);
+
+    while (i < len)
+    {
+        struct instruction inst;
+        u8 bytes_consumed = decode_instruction (&data[i], &inst);
+
+        if (bytes_consumed == 0)
+        {
+            break;
+        }
+
+        ASSERT (batch.count < capacity);
+        batch_store (&batch, batch.count++, (u32) i, bytes_consumed, &inst);
+        i += bytes_consumed;
+    }
+
+    arena_trim (arena, &batch.imm[batch.count]);
+
+    if (decoded_len)
+    {
+        *decoded_len = i;
+    }
+
+    return batch;
+}
+
+/* full record of instruction n */
+static void
+batch_get (struct inst_batch *batch, u32 n, struct instruction *inst)
+{
+    ASSERT (n < batch->count);
+
+    decode_instruction (&batch->data[batch->offset[n]], inst);
+}
+
+/* writes the index of every instruction that writes to memory to out
+ * (which must have room for batch->count entries), returns how many */
+static u32
+batch_find_memory_writes (struct inst_batch *batch, u32 *out)
+{
+    u8 *flags = batch->flags;
+    u32 count = batch->count;
+    u32 n = 0;
+
+    for (u32 i = 0; i < count; i++)
+    {
+        out[n] = i;
+        n += (flags[i] & INST_WRITES_MEM) != 0;
+    }
+
+    return n;
+}
+
+/* prints every instruction that writes to memory with its address */
+static void
+batch_print_memory_writes (struct arena *arena, struct inst_batch *batch)
+{
+    struct arena_mark mark = arena_mark (arena);
+    u32 *writes = arena_push_array_nozero (arena, u32, batch->count);
+    u32 n = batch_find_memory_writes (batch, writes);
+    u32 end = batch->count ? batch->offset[batch->count - 1] + batch->len[batch->count - 1] : 0;
+
+    format_offset_digits = offset_digits (end);
+
+    for (u32 i = 0; i < n; i++)
+    {
+        struct instruction inst;
+        u32 offset = batch->offset[writes[i]];
+
+        batch_get (batch, writes[i], &inst);
+        if (!format->has_offset && !format_listing)
+        {
+            u8 *p = output_reserve (FORMAT_MAX_LINE);
+            p = put_hex (p, offset, format_offset_digits);
+            output_commit (put_str (p, ": "));
+        }
+        format_instruction (&inst, offset, &batch->data[offset], batch->len[writes[i]]);
+    }
+    output_flush ();
+
+    arena_pop_to (mark);
+}
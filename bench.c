@@ -0,0 +1,491 @@
+/**
+ * Decoder benchmark
+ *
+ * Generates a deterministic stream of random (but valid) 8086
+ * instructions from the families in decode_table and times how fast
+ * we can decode and format it.
+ *
+ * Each phase is repeated and we report the min and median time, the
+ * throughput of the min run, and the page faults taken per repetition.
+ */
+
+enum family
+{
+    FAMILY_MOV,
+    FAMILY_ADD,
+    FAMILY_SUB,
+    FAMILY_CMP,
+    FAMILY_COUNT
+};
+
+static char *family_names[FAMILY_COUNT] = {
+    [FAMILY_MOV] = "mov",
+    [FAMILY_ADD] = "add",
+    [FAMILY_SUB] = "sub",
+    [FAMILY_CMP] = "cmp",
+};
+
+struct bench_config
+{
+    u32 bytes;           // size of the generated corpus
+    u32 repeats;         // how many times each phase is run
+    u64 seed;
+
+    u32 mix[FAMILY_COUNT]; // relative weight of each instruction family
+    u32 mod[4];            // relative weight of each MOD field value
+    u32 wide_pct;          // chance of a 16-bit (w=1) instruction
+    u32 imm_pct;           // chance of an immediate form
+};
+
+static struct bench_config bench_defaults = {
+    .bytes = 1 << 20,
+    .repeats = 10,
+    .seed = 0x8086,
+    .mix = { 4, 2, 2, 2 },
+    .mod = { 1, 1, 1, 2 },
+    .wide_pct = 50,
+    .imm_pct = 30,
+};
+
+/* xorshift64* */
+static u64
+rng_next (u64 *state)
+{
+    u64 x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 2685821657736338717ull;
+}
+
+static u32
+rng_range (u64 *state, u32 n)
+{
+    return (u32) ((rng_next (state) >> 32) % n);
+}
+
+static u32
+rng_pick (u64 *state, u32 *weights, u32 count)
+{
+    u32 total = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+        total += weights[i];
+    }
+
+    u32 r = rng_range (state, total);
+    for (u32 i = 0; i < count; i++)
+    {
+        if (r < weights[i])
+        {
+            return i;
+        }
+        r -= weights[i];
+    }
+
+    return count - 1;
+}
+
+static u8 *
+gen_disp (u8 *out, u64 *rng, u8 mod, u8 rm)
+{
+    if (mod == 0b01)
+    {
+        *out++ = (u8) rng_next (rng);
+    }
+    else if (mod == 0b10 || (mod == 0b00 && rm == 0b110))
+    {
+        u16 disp = (u16) rng_next (rng);
+        *out++ = disp & 0xFF;
+        *out++ = disp >> 8;
+    }
+
+    return out;
+}
+
+static u8 *
+gen_data (u8 *out, u64 *rng, u8 wide)
+{
+    u16 data = (u16) rng_next (rng);
+
+    *out++ = data & 0xFF;
+    if (wide)
+    {
+        *out++ = data >> 8;
+    }
+
+    return out;
+}
+
+/* writes one instruction to out, returns the end of it (at most 6 bytes) */
+static u8 *
+gen_instruction (u8 *out, u64 *rng, struct bench_config *config)
+{
+    /* first byte of the reg/mem with register form, and the
+     * REG field used by the shared 100000xx immediate form */
+    static u8 rm2r_opcodes[FAMILY_COUNT] = { 0b10001000, 0b00000000, 0b00101000, 0b00111000 };
+    static u8 i2a_opcodes[FAMILY_COUNT]  = { 0,          0b00000100, 0b00101100, 0b00111100 };
+    static u8 i2rm_ext[FAMILY_COUNT]     = { 0,          0b000,      0b101,      0b111 };
+
+    u32 family = rng_pick (rng, config->mix, FAMILY_COUNT);
+    u8 w = rng_range (rng, 100) < config->wide_pct;
+    u8 mod = rng_pick (rng, config->mod, 4);
+    u8 reg = rng_range (rng, 8);
+    u8 rm = rng_range (rng, 8);
+    bool immediate = rng_range (rng, 100) < config->imm_pct;
+
+    if (!immediate)
+    {
+        u8 d = rng_range (rng, 2);
+
+        *out++ = rm2r_opcodes[family] | (d << 1) | w;
+        *out++ = (mod << 6) | (reg << 3) | rm;
+        out = gen_disp (out, rng, mod, rm);
+    }
+    else if (family == FAMILY_MOV && rng_range (rng, 2) == 0)
+    {
+        // mov (immediate to register)
+        *out++ = 0b10110000 | (w << 3) | reg;
+        out = gen_data (out, rng, w);
+    }
+    else if (family == FAMILY_MOV)
+    {
+        // mov (immediate to reg/memory)
+        *out++ = 0b11000110 | w;
+        *out++ = (mod << 6) | rm;
+        out = gen_disp (out, rng, mod, rm);
+        out = gen_data (out, rng, w);
+    }
+    else if (rng_range (rng, 4) == 0)
+    {
+        // immediate to accumulator
+        *out++ = i2a_opcodes[family] | w;
+        out = gen_data (out, rng, w);
+    }
+    else
+    {
+        // immediate to reg/memory, s=1 sign-extends an 8-bit immediate
+        u8 s = w ? rng_range (rng, 2) : 0;
+
+        *out++ = 0b10000000 | (s << 1) | w;
+        *out++ = (mod << 6) | (i2rm_ext[family] << 3) | rm;
+        out = gen_disp (out, rng, mod, rm);
+        out = gen_data (out, rng, w && !s);
+    }
+
+    return out;
+}
+
+/* fills buf with whole instructions, returns how many bytes were used */
+static u32
+gen_corpus (u8 *buf, u32 len, struct bench_config *config)
+{
+    u64 rng = config->seed ? config->seed : 1;
+    u8 *ptr = buf;
+    u8 *end = buf + len;
+    u8 tmp[8];
+
+    for (;;)
+    {
+        u8 *tmp_end = gen_instruction (tmp, &rng, config);
+        u32 n = (u32) (tmp_end - tmp);
+
+        if (ptr + n > end)
+        {
+            break;
+        }
+
+        memcpy (ptr, tmp, n);
+        ptr += n;
+    }
+
+    return (u32) (ptr - buf);
+}
+
+struct bench_result
+{
+    char *name;
+    u64 min_ns;
+    u64 median_ns;
+    u64 faults;
+};
+
+static int
+u64_compare (const void *a, const void *b)
+{
+    u64 x = *(const u64 *) a;
+    u64 y = *(const u64 *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+bench_result_finish (struct bench_result *result, u64 *times, u32 repeats, u64 faults)
+{
+    qsort (times, repeats, sizeof (times[0]), u64_compare);
+
+    result->min_ns = times[0];
+    result->median_ns = times[repeats / 2];
+    result->faults = faults / repeats;
+}
+
+static void
+bench_result_print (struct bench_result *result, u32 bytes, u32 count)
+{
+    double seconds = (double) result->min_ns / 1e9;
+
+    printf ("%-16s %10.3f %10.3f %10.1f %10.2f %10llu\n",
+            result->name,
+            (double) result->min_ns / 1e6,
+            (double) result->median_ns / 1e6,
+            ((double) bytes / (1024.0 * 1024.0)) / seconds,
+            ((double) count / 1e6) / seconds,
+            (unsigned long long) result->faults);
+}
+
+static int
+bench_run (struct arena *arena, struct bench_config *config)
+{
+    struct arena_mark mark = arena_mark (arena);
+    u32 repeats = config->repeats ? config->repeats : 1;
+    u64 *times = arena_push_array (arena, u64, repeats);
+    u8 *corpus = arena_push (arena, config->bytes + 16);
+    struct bench_result results[] = {
+        { .name = "decode" },
+        { .name = "format" },
+        { .name = "decode+format" },
+        { .name = "batch decode" },
+        { .name = "scan records" },
+        { .name = "scan batch" },
+    };
+
+    u32 len = gen_corpus (corpus, config->bytes, config);
+
+    /* decode everything once up front, the records (and their lengths,
+     * for formats that print offsets) are kept around so the format
+     * phase measures formatting alone */
+    u32 count = 0;
+    int decoded_len = 0;
+    u8 *lens = NULL;
+    struct instruction *insts = decode_all (arena, corpus, len, &count, &decoded_len, &lens);
+    if (decoded_len != (int) len)
+    {
+        fprintf (stderr, "Error: corpus failed to decode at offset %d\n", decoded_len);
+        arena_pop_to (mark);
+        return 1;
+    }
+
+    FILE *out = fp;
+    fp = fopen (NULL_DEVICE, "w");
+    ASSERT (fp);
+    setvbuf (fp, arena_push_nozero (arena, OUTPUT_BUFFER_SIZE), _IOFBF, OUTPUT_BUFFER_SIZE);
+
+    // decode
+    {
+        u64 faults = page_faults ();
+        u64 checksum = 0;
+
+        for (u32 r = 0; r < repeats; r++)
+        {
+            u64 start = time_now_ns ();
+            for (u32 i = 0; i < len;)
+            {
+                struct instruction inst;
+                i += decode_instruction (&corpus[i], &inst);
+                checksum += inst.disp + inst.operands[1].data;
+            }
+            times[r] = time_now_ns () - start;
+        }
+
+        bench_result_finish (&results[0], times, repeats, page_faults () - faults);
+        fprintf (fp, "%llu\n", (unsigned long long) checksum);
+    }
+
+    // format
+    {
+        u64 faults = page_faults ();
+
+        format_offset_digits = offset_digits (len);
+
+        for (u32 r = 0; r < repeats; r++)
+        {
+            u64 start = time_now_ns ();
+            for (u32 j = 0, offset = 0; j < count; j++)
+            {
+                format_instruction (&insts[j], offset, &corpus[offset], lens[j]);
+                offset += lens[j];
+            }
+            output_flush ();
+            fflush (fp);
+            times[r] = time_now_ns () - start;
+        }
+
+        bench_result_finish (&results[1], times, repeats, page_faults () - faults);
+    }
+
+    // decode+format
+    {
+        u64 faults = page_faults ();
+
+        for (u32 r = 0; r < repeats; r++)
+        {
+            u64 start = time_now_ns ();
+            decode (corpus, len);
+            fflush (fp);
+            times[r] = time_now_ns () - start;
+        }
+
+        bench_result_finish (&results[2], times, repeats, page_faults () - faults);
+    }
+
+    // batch decode
+    struct inst_batch batch = {0};
+    {
+        u64 faults = page_faults ();
+
+        for (u32 r = 0; r < repeats; r++)
+        {
+            struct arena_mark batch_mark = arena_mark (arena);
+
+            u64 start = time_now_ns ();
+            batch = batch_decode (arena, corpus, len, NULL);
+            times[r] = time_now_ns () - start;
+
+            if (r + 1 < repeats)
+            {
+                arena_pop_to (batch_mark);
+            }
+        }
+
+        bench_result_finish (&results[3], times, repeats, page_faults () - faults);
+        ASSERT (batch.count == count);
+    }
+
+    /* find all writes to memory, once from the records and once from
+     * the batch flags column */
+    u32 *writes = arena_push_array (arena, u32, count);
+    u32 record_writes = 0;
+    u32 batch_writes = 0;
+    {
+        u64 faults = page_faults ();
+
+        for (u32 r = 0; r < repeats; r++)
+        {
+            u64 start = time_now_ns ();
+            record_writes = 0;
+            for (u32 j = 0; j < count; j++)
+            {
+                struct instruction *inst = &insts[j];
+                bool dst_mem = (inst->operands[0].mode == MEMORY ||
+                                inst->operands[0].mode == DIRECT_ADDRESS);
+
+                writes[record_writes] = j;
+                record_writes += dst_mem && inst->op != OP_CMP;
+            }
+            times[r] = time_now_ns () - start;
+        }
+
+        bench_result_finish (&results[4], times, repeats, page_faults () - faults);
+    }
+    {
+        u64 faults = page_faults ();
+
+        for (u32 r = 0; r < repeats; r++)
+        {
+            u64 start = time_now_ns ();
+            batch_writes = batch_find_memory_writes (&batch, writes);
+            times[r] = time_now_ns () - start;
+        }
+
+        bench_result_finish (&results[5], times, repeats, page_faults () - faults);
+        ASSERT (batch_writes == record_writes);
+    }
+
+    fclose (fp);
+    fp = out;
+
+    printf ("corpus: %u bytes, %u instructions (%u write memory), seed 0x%llx, %u repeats\n",
+            len, count, batch_writes, (unsigned long long) config->seed, repeats);
+    printf ("mix:");
+    for (u32 f = 0; f < FAMILY_COUNT; f++)
+    {
+        printf (" %s=%u", family_names[f], config->mix[f]);
+    }
+    printf ("  mod=%u,%u,%u,%u  wide=%u%%  imm=%u%%  syntax=%s%s\n\n",
+            config->mod[0], config->mod[1], config->mod[2], config->mod[3],
+            config->wide_pct, config->imm_pct, format->name,
+            format_listing ? " listing" : "");
+
+    printf ("%-16s %10s %10s %10s %10s %10s\n",
+            "phase", "min ms", "median ms", "MB/s", "Minst/s", "faults/rep");
+    for (u32 i = 0; i < ARRAY_COUNT (results); i++)
+    {
+        bench_result_print (&results[i], len, count);
+    }
+
+    arena_pop_to (mark);
+
+    return 0;
+}
+
+/* parses "mov=4,add=1" style weights, unknown names are an error */
+static bool
+bench_parse_mix (struct bench_config *config, char *arg)
+{
+    char *name = arg;
+
+    while (name && *name)
+    {
+        char *value = strchr (name, '=');
+        char *next = strchr (name, ',');
+        bool found = false;
+
+        if (!value || (next && next < value))
+        {
+            return false;
+        }
+
+        for (u32 f = 0; f < FAMILY_COUNT; f++)
+        {
+            if (strncmp (name, family_names[f], value - name) == 0 &&
+                strlen (family_names[f]) == (size_t) (value - name))
+            {
+                config->mix[f] = (u32) strtoul (value + 1, NULL, 0);
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            return false;
+        }
+
+        name = next ? next + 1 : NULL;
+    }
+
+    return true;
+}
+
+/* parses "1,1,1,2" as the weights of MOD 00, 01, 10 and 11 */
+static bool
+bench_parse_mod (struct bench_config *config, char *arg)
+{
+    char *ptr = arg;
+
+    for (int i = 0; i < 4; i++)
+    {
+        char *end = NULL;
+
+        config->mod[i] = (u32) strtoul (ptr, &end, 0);
+        if (end == ptr || (i < 3 && *end != ','))
+        {
+            return false;
+        }
+        ptr = end + 1;
+    }
+
+    return true;
+}
@@ -6,6 +6,10 @@ call "%USERPROFILE%\code\msvc\setup.bat"
 
 for %%f in (listing_*.asm) do (call nasm %%f)
 
-cl.exe -nologo main.c
+rem "build.bat avx2" builds the 16-lane AVX2 executor, the default is 8 lanes of SSE2
+set arch=
+if "%1" == "avx2" set arch=/arch:AVX2
+
+cl.exe -nologo %arch% main.c
 
 ctags -R --langmap=c:.c.h --languages=c .
@@ -0,0 +1,22 @@
+#!/bin/sh
+
+set -e
+
+cd "$(dirname "$0")"
+
+# "./build.sh avx2" builds the 16-lane AVX2 executor, the default is 8 lanes of SSE2
+arch=""
+if [ "$1" = "avx2" ]; then
+    arch="-mavx2"
+fi
+
+cc -O2 -g -Wall -pthread $arch -o main main.c
+
+# decoder conformance sweep, takes well under a second
+./main --sweep
+
+# vector executor against the scalar one
+./main --lanes-check
+
+# --replay against a step-by-step run
+./main --trace-check
@@ -0,0 +1,313 @@
+/**
+ * Output cache
+ *
+ * --cache DIR keeps the output of every disassembly on disk, keyed by a
+ * hash of the input bytes and everything that changes the output (the
+ * syntax, --listing, --mem-writes). A repeat run of the same input only
+ * reads and hashes it, maps the cached file and writes it out; the
+ * decoder never runs.
+ *
+ * Each entry is DIR/<key>.out: a cache_header then the output text.
+ * Entries are written to a temporary name and renamed into place, so
+ * concurrent runs sharing a directory never see half an entry. A hit
+ * bumps the entry's modification time; when a new entry takes the
+ * directory over --cache-size, the least recently used ones go.
+ *
+ * The directory is listed once up front for its size and after that
+ * only when the running total goes over the limit. Other runs sharing
+ * the directory aren't counted until then, the scan that evicts picks
+ * up the real total.
+ */
+
+#define CACHE_VERSION 3 // bump whenever the output of any mode changes
+#define CACHE_DEFAULT_SIZE (256ull << 20)
+
+struct cache_header
+{
+    char magic[4]; // "T86C"
+    u32 version;
+    u64 key;
+    u64 input_len;
+    u64 reserved;
+};
+
+struct cache
+{
+    char *dir;
+    u64 max_bytes;
+    u64 total;     // bytes of entries in the directory, as far as we know
+    u32 hits;
+    u32 misses;
+};
+
+static u64
+hash_mix (u64 h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/* 64-bit hash of a byte string, four independent lanes of 8 bytes so
+ * the multiplies overlap */
+static u64
+hash_bytes (u8 *data, u64 len, u64 seed)
+{
+    u64 lanes[4] = {
+        seed ^ 0x9e3779b97f4a7c15ull,
+        seed ^ 0xbf58476d1ce4e5b9ull,
+        seed ^ 0x94d049bb133111ebull,
+        seed ^ 0x2545f4914f6cdd1dull,
+    };
+    u64 i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        for (int l = 0; l < 4; l++)
+        {
+            u64 v;
+            memcpy (&v, &data[i + l * 8], 8);
+            lanes[l] = (lanes[l] ^ v) * 0x9fb21c651e98df25ull;
+            lanes[l] ^= lanes[l] >> 31;
+        }
+    }
+
+    u64 h = len;
+    for (int l = 0; l < 4; l++)
+    {
+        h = (h ^ hash_mix (lanes[l])) * 0x9e3779b97f4a7c15ull;
+    }
+
+    // the last 0-31 bytes
+    for (; i + 8 <= len; i += 8)
+    {
+        u64 v;
+        memcpy (&v, &data[i], 8);
+        h = hash_mix (h ^ v);
+    }
+    u64 tail = 0;
+    for (u32 shift = 0; i < len; i++, shift += 8)
+    {
+        tail |= (u64) data[i] << shift;
+    }
+
+    return hash_mix (h ^ tail ^ 0xa0761d6478bd642full);
+}
+
+/* the options that change the output go into the key next to the input */
+static u64
+cache_key (u8 *data, u32 len, bool mem_writes)
+{
+    u64 options = CACHE_VERSION;
+
+    options = options * 31 + (u64) (format - formats);
+    options = options * 31 + format_listing;
+    options = options * 31 + mem_writes;
+
+    return hash_bytes (data, len, hash_mix (options));
+}
+
+static void
+cache_path (char *path, size_t size, struct cache *cache, u64 key, char *suffix)
+{
+    snprintf (path, size, "%s/%016llx%s", cache->dir, (unsigned long long) key, suffix);
+}
+
+/* writes the entry's output to fp if it's there and matches */
+static bool
+cache_lookup (struct cache *cache, u64 key, u32 len)
+{
+    char path[4096];
+    u64 size = 0;
+    bool hit = false;
+
+    cache_path (path, sizeof (path), cache, key, ".out");
+    u8 *entry = os_map_file (path, &size);
+    if (!entry)
+    {
+        return false;
+    }
+
+    struct cache_header *header = (struct cache_header *) entry;
+    if (size >= sizeof (*header) &&
+        memcmp (header->magic, "T86C", 4) == 0 &&
+        header->version == CACHE_VERSION &&
+        header->key == key &&
+        header->input_len == len)
+    {
+        fwrite (entry + sizeof (*header), 1, size - sizeof (*header), fp);
+        hit = true;
+    }
+
+    os_unmap_file (entry, size);
+    if (hit)
+    {
+        os_touch_file (path);
+    }
+
+    return hit;
+}
+
+struct cache_entry
+{
+    char name[32];
+    u64 size;
+    u64 mtime;
+};
+
+struct cache_scan
+{
+    struct cache_entry *entries;
+    u32 count;
+    u32 capacity;
+    u64 total;
+};
+
+static void
+cache_scan_entry (void *context, char *name, u64 size, u64 mtime)
+{
+    struct cache_scan *scan = context;
+
+    scan->total += size;
+    if (scan->count < scan->capacity && strlen (name) < sizeof (scan->entries[0].name))
+    {
+        struct cache_entry *entry = &scan->entries[scan->count++];
+
+        strcpy (entry->name, name);
+        entry->size = size;
+        entry->mtime = mtime;
+    }
+}
+
+static int
+cache_entry_compare (const void *a, const void *b)
+{
+    const struct cache_entry *x = a;
+    const struct cache_entry *y = b;
+
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/* removes the least recently used entries until the directory fits, but
+ * never the one just written. Only called once the running total is over
+ * the limit */
+static void
+cache_evict (struct arena *arena, struct cache *cache, u64 keep)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct cache_scan scan = { .capacity = 1 << 16 };
+    char keep_name[32];
+    char path[4096];
+
+    scan.entries = arena_push_array_nozero (arena, struct cache_entry, scan.capacity);
+    os_list_dir (cache->dir, ".out", cache_scan_entry, &scan);
+
+    if (scan.total > cache->max_bytes)
+    {
+        snprintf (keep_name, sizeof (keep_name), "%016llx.out", (unsigned long long) keep);
+        qsort (scan.entries, scan.count, sizeof (scan.entries[0]), cache_entry_compare);
+
+        for (u32 i = 0; i < scan.count && scan.total > cache->max_bytes; i++)
+        {
+            if (strcmp (scan.entries[i].name, keep_name) != 0)
+            {
+                snprintf (path, sizeof (path), "%s/%s", cache->dir, scan.entries[i].name);
+                if (remove (path) == 0)
+                {
+                    scan.total -= scan.entries[i].size;
+                }
+            }
+        }
+    }
+
+    cache->total = scan.total;
+    arena_pop_to (mark);
+}
+
+static void
+cache_fill (struct arena *arena, u8 *data, int len, bool mem_writes)
+{
+    if (mem_writes)
+    {
+        struct inst_batch batch = batch_decode (arena, data, len, NULL);
+        batch_print_memory_writes (arena, &batch);
+    }
+    else
+    {
+        decode (data, len);
+    }
+}
+
+/* disassembles data (or lists its memory writes) through the cache */
+static void
+cache_run (struct arena *arena, struct cache *cache, u8 *data, int len, bool mem_writes)
+{
+    u64 key = cache_key (data, (u32) len, mem_writes);
+
+    if (cache_lookup (cache, key, (u32) len))
+    {
+        cache->hits++;
+        return;
+    }
+    cache->misses++;
+
+    /* miss: run it into a temporary entry, rename that into place and
+     * write it out from there like a hit */
+    char tmp_path[4096];
+    char path[4096];
+    struct cache_header header = { .magic = "T86C", .version = CACHE_VERSION, .key = key, .input_len = (u64) len };
+    FILE *out = fp;
+
+    snprintf (tmp_path, sizeof (tmp_path), "%s/%016llx.%llx.tmp", cache->dir,
+              (unsigned long long) key, (unsigned long long) time_now_ns ());
+    cache_path (path, sizeof (path), cache, key, ".out");
+
+    fp = fopen (tmp_path, "wb");
+    if (fp)
+    {
+        fwrite (&header, 1, sizeof (header), fp);
+        cache_fill (arena, data, len, mem_writes);
+
+        long size = ftell (fp);
+        bool ok = fclose (fp) == 0 && size > 0;
+        fp = out;
+        if (ok && os_rename (tmp_path, path) && cache_lookup (cache, key, (u32) len))
+        {
+            cache->total += (u64) size;
+            if (cache->total > cache->max_bytes)
+            {
+                cache_evict (arena, cache, key);
+            }
+            return;
+        }
+        remove (tmp_path);
+    }
+
+    // no cache entry, still do the work
+    fp = out;
+    fprintf (stderr, "Error: Could not write the cache entry '%s'\n", path);
+    cache_fill (arena, data, len, mem_writes);
+}
+
+static bool
+cache_init (struct cache *cache, char *dir, u64 max_bytes)
+{
+    *cache = (struct cache) { .dir = dir, .max_bytes = max_bytes ? max_bytes : CACHE_DEFAULT_SIZE };
+
+    if (!os_make_dir (dir))
+    {
+        fprintf (stderr, "Error: Could not create the cache directory '%s'\n", dir);
+        return false;
+    }
+
+    // just the total, no entries
+    struct cache_scan scan = {0};
+    os_list_dir (dir, ".out", cache_scan_entry, &scan);
+    cache->total = scan.total;
+
+    return true;
+}
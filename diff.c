@@ -0,0 +1,685 @@
+/**
+ * Instruction level diff
+ *
+ * --diff A B decodes both inputs and reports the instructions B removed,
+ * added or changed relative to A, with their addresses.
+ *
+ * Work is kept to the part that differs:
+ * - the instructions inside the common byte prefix decode the same in
+ *   both, they're only walked once to find where the prefix ends.
+ * - A is decoded from there to the end. B is decoded until it reaches an
+ *   instruction boundary inside the common byte suffix that A has at the
+ *   same distance from the end, everything after it is identical and
+ *   A's records are reused for it.
+ * - the middles are anchored on windows of DIFF_WINDOW instructions that
+ *   occur exactly once in each, in increasing order on both sides. Only
+ *   one window in DIFF_SAMPLE is considered, picked by its hash so both
+ *   sides pick the same ones, which keeps the table in cache. The gaps
+ *   between anchors go through Myers' linear space diff, which gives up
+ *   on a gap (reports it all as changed) past DIFF_MAX_COST.
+ *
+ * Instructions compare by their encoded bytes: at most 6, so a record's
+ * key holds them exactly along with the length.
+ */
+
+#define DIFF_WINDOW 8
+#define DIFF_SAMPLE_BITS 4 // one window in 16 can be an anchor
+#define DIFF_ROLL 0x9e3779b97f4a7c15ull
+#define DIFF_MAX_COST 4096
+#define DIFF_NONE 0xFFFFFFFFu
+#define DIFF_DUPLICATE 0xFFFFFFFEu
+
+struct diff_side
+{
+    u8 *data;
+    u32 len;
+    u32 count;   // instructions in the middle, the part that differs
+    u32 *offset; // of each instruction in data
+    u64 *key;    // its bytes, len in the top byte
+    u32 end;     // where the middle ends
+};
+
+enum diff_kind
+{
+    DIFF_REMOVED,
+    DIFF_ADDED,
+};
+
+struct diff_edit
+{
+    u32 a; // position in each side when the edit happens
+    u32 b;
+    u8 kind;
+    bool starts_hunk;
+};
+
+struct diff
+{
+    struct diff_side a;
+    struct diff_side b;
+
+    struct diff_edit *edits;
+    u32 edit_count;
+    bool in_hunk;
+    u64 same;
+
+    s32 *forward; // Myers' furthest reaching paths, per diagonal
+    s32 *backward;
+};
+
+static u64
+diff_key (u8 *bytes, u8 len)
+{
+    u64 v;
+
+    memcpy (&v, bytes, 8); // inputs are padded
+    return (v & ((1ull << (8 * len)) - 1)) | (u64) len << 56;
+}
+
+/* stores the instructions from start until decoding stops, or until sync
+ * (a bitmap of distances from the end, may be NULL) has an instruction
+ * boundary. Returns where it stopped */
+static u32
+diff_decode (struct arena *arena, struct diff_side *side, u32 start, u8 *sync, u32 sync_len)
+{
+    u32 capacity = (side->len - start) / 2 + 2;
+    u32 i = start;
+
+    side->offset = arena_push_array_nozero (arena, u32, capacity);
+    side->key = arena_push_array_nozero (arena, u64, capacity);
+    side->count = 0;
+
+    while (i < side->len)
+    {
+        struct instruction inst;
+
+        if (sync && side->len - i <= sync_len && sync[side->len - i])
+        {
+            break;
+        }
+
+        u8 bytes_consumed = decode_instruction (&side->data[i], &inst);
+        if (bytes_consumed == 0)
+        {
+            break;
+        }
+
+        side->offset[side->count] = i;
+        side->key[side->count] = diff_key (&side->data[i], bytes_consumed);
+        side->count++;
+        i += bytes_consumed;
+    }
+
+    return i;
+}
+
+static void
+diff_match (struct diff *d, u32 count)
+{
+    if (count)
+    {
+        d->same += count;
+        d->in_hunk = false;
+    }
+}
+
+static void
+diff_edit (struct diff *d, u8 kind, u32 a, u32 b)
+{
+    d->edits[d->edit_count++] = (struct diff_edit) { .a = a, .b = b, .kind = kind, .starts_hunk = !d->in_hunk };
+    d->in_hunk = true;
+}
+
+static void
+diff_replace (struct diff *d, u32 a0, u32 a1, u32 b0, u32 b1)
+{
+    for (u32 i = a0; i < a1; i++)
+    {
+        diff_edit (d, DIFF_REMOVED, i, b0);
+    }
+    for (u32 i = b0; i < b1; i++)
+    {
+        diff_edit (d, DIFF_ADDED, a1, i);
+    }
+}
+
+/* finds a point on a shortest edit path between a[a0..a1) and b[b0..b1)
+ * by running Myers' search from both ends until they meet. Both ranges
+ * are non-empty and start and end with a difference */
+static bool
+diff_split (struct diff *d, s32 a0, s32 a1, s32 b0, s32 b1, s32 *split_a, s32 *split_b)
+{
+    u64 *a = d->a.key;
+    u64 *b = d->b.key;
+    s32 dmin = a0 - b1;
+    s32 dmax = a1 - b0;
+    s32 fmid = a0 - b0;
+    s32 bmid = a1 - b1;
+    bool odd = (fmid - bmid) & 1;
+    s32 fmin = fmid, fmax = fmid;
+    s32 bmin = bmid, bmax = bmid;
+
+    // indexed by diagonal (x - y), dmin - 1 .. dmax + 1
+    s32 *forward = d->forward - dmin + 1;
+    s32 *backward = d->backward - dmin + 1;
+
+    forward[fmid] = a0;
+    backward[bmid] = a1;
+
+    for (s32 cost = 1; cost <= DIFF_MAX_COST; cost++)
+    {
+        if (fmin > dmin)
+        {
+            forward[--fmin - 1] = -1;
+        }
+        else
+        {
+            ++fmin;
+        }
+        if (fmax < dmax)
+        {
+            forward[++fmax + 1] = -1;
+        }
+        else
+        {
+            --fmax;
+        }
+
+        for (s32 k = fmax; k >= fmin; k -= 2)
+        {
+            s32 x = (forward[k - 1] >= forward[k + 1]) ? forward[k - 1] + 1 : forward[k + 1];
+            s32 y = x - k;
+
+            while (x < a1 && y < b1 && a[x] == b[y])
+            {
+                x++;
+                y++;
+            }
+            forward[k] = x;
+
+            if (odd && bmin <= k && k <= bmax && backward[k] <= x)
+            {
+                *split_a = x;
+                *split_b = y;
+                return true;
+            }
+        }
+
+        if (bmin > dmin)
+        {
+            backward[--bmin - 1] = INT32_MAX;
+        }
+        else
+        {
+            ++bmin;
+        }
+        if (bmax < dmax)
+        {
+            backward[++bmax + 1] = INT32_MAX;
+        }
+        else
+        {
+            --bmax;
+        }
+
+        for (s32 k = bmax; k >= bmin; k -= 2)
+        {
+            s32 x = (backward[k - 1] < backward[k + 1]) ? backward[k - 1] : backward[k + 1] - 1;
+            s32 y = x - k;
+
+            while (x > a0 && y > b0 && a[x - 1] == b[y - 1])
+            {
+                x--;
+                y--;
+            }
+            backward[k] = x;
+
+            if (!odd && fmin <= k && k <= fmax && x <= forward[k])
+            {
+                *split_a = x;
+                *split_b = y;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/* diffs a[a0..a1) against b[b0..b1), recording the edits in order */
+static void
+diff_range (struct diff *d, u32 a0, u32 a1, u32 b0, u32 b1)
+{
+    u64 *a = d->a.key;
+    u64 *b = d->b.key;
+    u32 prefix = 0;
+    u32 suffix = 0;
+
+    while (a0 < a1 && b0 < b1 && a[a0] == b[b0])
+    {
+        a0++;
+        b0++;
+        prefix++;
+    }
+    while (a1 > a0 && b1 > b0 && a[a1 - 1] == b[b1 - 1])
+    {
+        a1--;
+        b1--;
+        suffix++;
+    }
+    diff_match (d, prefix);
+
+    s32 split_a, split_b;
+    if (a0 == a1 || b0 == b1)
+    {
+        diff_replace (d, a0, a1, b0, b1);
+    }
+    else if (diff_split (d, (s32) a0, (s32) a1, (s32) b0, (s32) b1, &split_a, &split_b))
+    {
+        diff_range (d, a0, (u32) split_a, b0, (u32) split_b);
+        diff_range (d, (u32) split_a, a1, (u32) split_b, b1);
+    }
+    else
+    {
+        diff_replace (d, a0, a1, b0, b1); // too far apart to be worth aligning
+    }
+
+    diff_match (d, suffix);
+}
+
+struct diff_window
+{
+    u64 hash;
+    u32 a; // index of the window in each side, DIFF_NONE or DIFF_DUPLICATE
+    u32 b;
+};
+
+static bool
+diff_window_sampled (u64 hash)
+{
+    return (hash >> (64 - DIFF_SAMPLE_BITS)) == 0;
+}
+
+/* the sampled windows of key[0..count), a polynomial hash rolled along
+ * one instruction at a time and mixed. Returns how many */
+static u32
+diff_sample (u64 *key, u32 count, u32 *index, u64 *hash)
+{
+    u64 power = 1;
+    u64 roll = 0;
+    u32 n = 0;
+
+    for (int i = 0; i < DIFF_WINDOW; i++)
+    {
+        power *= DIFF_ROLL;
+    }
+
+    for (u32 i = 0; i < count; i++)
+    {
+        roll = roll * DIFF_ROLL + key[i];
+        if (i >= DIFF_WINDOW)
+        {
+            roll -= key[i - DIFF_WINDOW] * power;
+        }
+
+        u64 h = hash_mix (roll);
+        if (i + 1 >= DIFF_WINDOW && diff_window_sampled (h))
+        {
+            index[n] = i + 1 - DIFF_WINDOW;
+            hash[n++] = h;
+        }
+    }
+
+    return n;
+}
+
+static struct diff_window *
+diff_window_find (struct diff_window *table, u32 mask, u64 hash)
+{
+    u32 i = (u32) hash & mask;
+
+    while ((table[i].a != DIFF_NONE || table[i].b != DIFF_NONE) && table[i].hash != hash)
+    {
+        i = (i + 1) & mask;
+    }
+    table[i].hash = hash;
+
+    return &table[i];
+}
+
+static void
+diff_window_add (u32 *slot, u32 index)
+{
+    *slot = (*slot == DIFF_NONE) ? index : DIFF_DUPLICATE;
+}
+
+/* windows that occur once in each middle, as (a, b) pairs in b order,
+ * then the longest run of them also in a order. Returns how many */
+static u32
+diff_anchors (struct arena *arena, struct diff *d, u32 na, u32 nb, u32 *anchor_a, u32 *anchor_b)
+{
+    u32 wa = (na >= DIFF_WINDOW) ? na - DIFF_WINDOW + 1 : 0;
+    u32 wb = (nb >= DIFF_WINDOW) ? nb - DIFF_WINDOW + 1 : 0;
+    u32 size = 16;
+
+    if (wa == 0 || wb == 0)
+    {
+        return 0;
+    }
+
+    u32 *sampled_a = arena_push_array_nozero (arena, u32, wa);
+    u64 *hash_a = arena_push_array_nozero (arena, u64, wa);
+    u32 *sampled_b = arena_push_array_nozero (arena, u32, wb);
+    u64 *hash_b = arena_push_array_nozero (arena, u64, wb);
+    u32 samples_a = diff_sample (d->a.key, na, sampled_a, hash_a);
+    u32 samples = diff_sample (d->b.key, nb, sampled_b, hash_b);
+
+    while (size < 2 * (samples_a + samples))
+    {
+        size *= 2;
+    }
+    struct diff_window *table = arena_push_array_nozero (arena, struct diff_window, size);
+    memset (table, 0xFF, sizeof (*table) * size);
+
+    for (u32 s = 0; s < samples_a; s++)
+    {
+        diff_window_add (&diff_window_find (table, size - 1, hash_a[s])->a, sampled_a[s]);
+    }
+    for (u32 s = 0; s < samples; s++)
+    {
+        diff_window_add (&diff_window_find (table, size - 1, hash_b[s])->b, sampled_b[s]);
+    }
+
+    /* longest increasing subsequence of a over the matches in b order:
+     * tails[l] is the match ending the best run of length l + 1 */
+    u32 *match_a = arena_push_array_nozero (arena, u32, wb);
+    u32 *match_b = arena_push_array_nozero (arena, u32, wb);
+    u32 *prev = arena_push_array_nozero (arena, u32, wb);
+    u32 *tails = arena_push_array_nozero (arena, u32, wb);
+    u32 matches = 0;
+    u32 longest = 0;
+
+    for (u32 s = 0; s < samples; s++)
+    {
+        u32 i = sampled_b[s];
+        struct diff_window *w = diff_window_find (table, size - 1, hash_b[s]);
+
+        if (w->a >= DIFF_DUPLICATE || w->b != i ||
+            memcmp (&d->a.key[w->a], &d->b.key[i], DIFF_WINDOW * sizeof (u64)) != 0)
+        {
+            continue;
+        }
+
+        u32 lo = 0, hi = longest;
+        while (lo < hi)
+        {
+            u32 mid = (lo + hi) / 2;
+            if (match_a[tails[mid]] < w->a)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+
+        match_a[matches] = w->a;
+        match_b[matches] = i;
+        prev[matches] = lo ? tails[lo - 1] : DIFF_NONE;
+        tails[lo] = matches;
+        longest = (lo == longest) ? longest + 1 : longest;
+        matches++;
+    }
+
+    u32 m = longest ? tails[longest - 1] : DIFF_NONE;
+    for (u32 n = longest; n > 0; n--)
+    {
+        anchor_a[n - 1] = match_a[m];
+        anchor_b[n - 1] = match_b[m];
+        m = prev[m];
+    }
+
+    return longest;
+}
+
+static void
+diff_print_line (struct diff_side *side, u32 n, char *marker)
+{
+    struct instruction inst;
+    u32 offset = side->offset[n];
+    u8 len = (u8) (side->key[n] >> 56);
+    u8 *p = output_reserve (FORMAT_MAX_LINE);
+
+    p = put_str (p, marker);
+    if (!format_listing)
+    {
+        p = put_hex (p, offset, format_offset_digits);
+        p = put_str (p, ": ");
+    }
+    output_commit (p);
+
+    decode_instruction (&side->data[offset], &inst);
+    format_instruction (&inst, offset, &side->data[offset], len);
+}
+
+static u32
+diff_position (struct diff_side *side, u32 n)
+{
+    return (n < side->count) ? side->offset[n] : side->end;
+}
+
+/* one hunk per run of edits between matches. Removals and additions
+ * pair up as changes, the rest are plain removals or additions */
+static void
+diff_print (struct diff *d, u32 *changed, u32 *removed, u32 *added)
+{
+    // one width for both sides so the addresses line up
+    format_offset_digits = offset_digits (d->a.len > d->b.len ? d->a.len : d->b.len);
+
+    for (u32 i = 0; i < d->edit_count;)
+    {
+        u32 end = i + 1;
+        u32 r = 0, a = 0;
+
+        while (end < d->edit_count && !d->edits[end].starts_hunk)
+        {
+            end++;
+        }
+        for (u32 e = i; e < end; e++)
+        {
+            r += d->edits[e].kind == DIFF_REMOVED;
+            a += d->edits[e].kind == DIFF_ADDED;
+        }
+
+        u8 *p = output_reserve (FORMAT_MAX_LINE);
+        p = put_str (p, "@@ -");
+        p = put_hex (p, diff_position (&d->a, d->edits[i].a), format_offset_digits);
+        p = put_str (p, ",");
+        p = put_u32 (p, r);
+        p = put_str (p, " +");
+        p = put_hex (p, diff_position (&d->b, d->edits[i].b), format_offset_digits);
+        p = put_str (p, ",");
+        p = put_u32 (p, a);
+        output_commit (put_str (p, " @@\n"));
+
+        u32 pairs = (r < a) ? r : a;
+        u32 next_r = i, next_a = i;
+        for (u32 n = 0; n < r + a - pairs; n++)
+        {
+            while (next_r < end && d->edits[next_r].kind != DIFF_REMOVED)
+            {
+                next_r++;
+            }
+            while (next_a < end && d->edits[next_a].kind != DIFF_ADDED)
+            {
+                next_a++;
+            }
+
+            if (n < pairs)
+            {
+                diff_print_line (&d->a, d->edits[next_r++].a, "< ");
+                diff_print_line (&d->b, d->edits[next_a++].b, "> ");
+            }
+            else if (next_r < end)
+            {
+                diff_print_line (&d->a, d->edits[next_r++].a, "- ");
+            }
+            else
+            {
+                diff_print_line (&d->b, d->edits[next_a++].b, "+ ");
+            }
+        }
+
+        *changed += pairs;
+        *removed += r - pairs;
+        *added += a - pairs;
+        i = end;
+    }
+}
+
+/* returns 0 if A and B decode to the same instructions, 1 if they don't,
+ * like diff(1) */
+static int
+diff_run (struct arena *arena, char *file_a, char *file_b)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct diff d = {0};
+
+    char *error = NULL;
+
+    d.a.data = read_file (arena, file_a, 0, 1, &d.a.len, &error);
+    d.b.data = d.a.data ? read_file (arena, file_b, 0, 1, &d.b.len, &error) : NULL;
+    if (!d.b.data)
+    {
+        fprintf (stderr, "Error: Could not read '%s': %s\n", d.a.data ? file_b : file_a, error);
+        arena_pop_to (mark);
+        return 2;
+    }
+
+    u32 shortest = (d.a.len < d.b.len) ? d.a.len : d.b.len;
+    u32 prefix_bytes = 0;
+    u32 suffix_bytes = 0;
+
+    while (prefix_bytes < shortest && d.a.data[prefix_bytes] == d.b.data[prefix_bytes])
+    {
+        prefix_bytes++;
+    }
+    while (suffix_bytes < shortest && d.a.data[d.a.len - 1 - suffix_bytes] == d.b.data[d.b.len - 1 - suffix_bytes])
+    {
+        suffix_bytes++;
+    }
+
+    // instructions entirely inside the common prefix are the same in both
+    u32 start = 0;
+    u64 prefix = 0;
+    while (start < prefix_bytes)
+    {
+        struct instruction inst;
+        u8 bytes_consumed = decode_instruction (&d.a.data[start], &inst);
+
+        if (bytes_consumed == 0 || start + bytes_consumed > prefix_bytes)
+        {
+            break;
+        }
+        start += bytes_consumed;
+        prefix++;
+    }
+
+    /* A to the end, marking its instruction boundaries in the common
+     * suffix by distance from the end. Where decoding stops counts too:
+     * B stops at the same place from there */
+    u8 *sync = arena_push (arena, (u64) suffix_bytes + 1);
+    u32 decoded_a = diff_decode (arena, &d.a, start, NULL, 0);
+
+    d.a.end = decoded_a;
+    for (u32 n = 0; n <= d.a.count; n++)
+    {
+        u32 distance = d.a.len - diff_position (&d.a, n);
+        if (distance <= suffix_bytes)
+        {
+            sync[distance] = 1;
+        }
+    }
+
+    u32 decoded_b = diff_decode (arena, &d.b, start, sync, suffix_bytes);
+    u32 distance = d.b.len - decoded_b;
+    u32 suffix = 0;
+
+    d.b.end = decoded_b;
+    if (distance <= suffix_bytes && sync[distance])
+    {
+        // B is the same as A from here, A's records past it are shared
+        u32 lo = 0, hi = d.a.count;
+        while (lo < hi)
+        {
+            u32 mid = (lo + hi) / 2;
+            if (d.a.offset[mid] < d.a.len - distance)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+
+        suffix = d.a.count - lo;
+        d.a.count = lo;
+        d.a.end = d.a.len - distance;
+        decoded_b = d.b.len - (d.a.len - decoded_a);
+    }
+
+    u32 *anchor_a = arena_push_array_nozero (arena, u32, d.b.count + 1);
+    u32 *anchor_b = arena_push_array_nozero (arena, u32, d.b.count + 1);
+    u32 anchors = diff_anchors (arena, &d, d.a.count, d.b.count, anchor_a, anchor_b);
+    u32 cost_size = d.a.count + d.b.count + 3;
+
+    d.edits = arena_push_array_nozero (arena, struct diff_edit, d.a.count + d.b.count);
+    d.forward = arena_push_array_nozero (arena, s32, cost_size);
+    d.backward = arena_push_array_nozero (arena, s32, cost_size);
+    d.same = prefix + suffix;
+
+    /* the gaps between anchors, an anchor that overlaps the last one is
+     * only any use if it continues it on the same diagonal */
+    u32 a = 0, b = 0;
+    for (u32 n = 0; n < anchors; n++)
+    {
+        u32 anchor_end_a = anchor_a[n] + DIFF_WINDOW;
+        u32 anchor_end_b = anchor_b[n] + DIFF_WINDOW;
+
+        if (anchor_a[n] >= a && anchor_b[n] >= b)
+        {
+            diff_range (&d, a, anchor_a[n], b, anchor_b[n]);
+            diff_match (&d, DIFF_WINDOW);
+            a = anchor_end_a;
+            b = anchor_end_b;
+        }
+        else if (anchor_a[n] - anchor_b[n] == a - b && anchor_end_a > a)
+        {
+            diff_match (&d, anchor_end_a - a);
+            a = anchor_end_a;
+            b = anchor_end_b;
+        }
+    }
+    diff_range (&d, a, d.a.count, b, d.b.count);
+
+    u32 changed = 0, removed = 0, added = 0;
+    diff_print (&d, &changed, &removed, &added);
+    output_flush ();
+
+    fprintf (fp, "diff: %u changed, %u removed, %u added, %llu the same\n",
+             changed, removed, added, (unsigned long long) d.same);
+    if (decoded_a < d.a.len)
+    {
+        fprintf (fp, "diff: %s stops decoding at 0x%05x\n", file_a, decoded_a);
+    }
+    if (decoded_b < d.b.len)
+    {
+        fprintf (fp, "diff: %s stops decoding at 0x%05x\n", file_b, decoded_b);
+    }
+
+    arena_pop_to (mark);
+
+    return (d.edit_count || decoded_a - d.a.len != decoded_b - d.b.len) ? 1 : 0;
+}
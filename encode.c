@@ -0,0 +1,231 @@
+/**
+ * Encoder
+ *
+ * Turns an instruction record back into machine code from what it
+ * says, its op, width and operands, not from the raw fields the decoder
+ * copied out of the input. A disassembly that shows the wrong operand
+ * therefore encodes to different bytes and --verify catches it.
+ *
+ * Where the same instruction has more than one encoding (mov to a
+ * register has two immediate forms, add ax has an accumulator form,
+ * register to register can go either way round, a displacement can be
+ * wider than it needs to be) the form it was decoded from (encoding,
+ * d, s, mod) picks between them. Those fields never change what the
+ * instruction does.
+ */
+
+/* first byte of the reg/memory with register form */
+static u8 encode_rm_reg_opcodes[] = {
+    [OP_MOV] = 0b10001000,
+    [OP_ADD] = 0b00000000,
+    [OP_SUB] = 0b00101000,
+    [OP_CMP] = 0b00111000,
+};
+
+/* REG field of the immediate to reg/memory form */
+static u8 encode_imm_rm_ext[] = {
+    [OP_MOV] = 0b000,
+    [OP_ADD] = 0b000,
+    [OP_SUB] = 0b101,
+    [OP_CMP] = 0b111,
+};
+
+/* first byte of the immediate to accumulator form */
+static u8 encode_imm_acc_opcodes[] = {
+    [OP_ADD] = 0b00000100,
+    [OP_SUB] = 0b00101100,
+    [OP_CMP] = 0b00111100,
+};
+
+static bool
+encode_fits_s8 (u16 value)
+{
+    return (u16) (s16) (s8) value == value;
+}
+
+/* ModRM (with REG set to reg) and displacement for the reg/memory
+ * operand rm, returns how many bytes were written */
+static u8
+encode_modrm (u8 *buf, struct instruction *inst, struct operand *rm, u8 reg)
+{
+    u8 i = 0;
+
+    if (rm->mode == REGISTER)
+    {
+        buf[i++] = (0b11 << 6) | (reg << 3) | rm->index;
+    }
+    else if (rm->mode == DIRECT_ADDRESS)
+    {
+        buf[i++] = (0b00 << 6) | (reg << 3) | 0b110;
+        buf[i++] = rm->direct_address & 0xFF;
+        buf[i++] = rm->direct_address >> 8;
+    }
+    else
+    {
+        /* the shortest displacement that holds it, unless the input used
+         * a longer one. [bp] has no form without a displacement */
+        u8 mod = 0b00;
+        if (rm->disp != 0 || rm->index == 0b110)
+        {
+            mod = encode_fits_s8 (rm->disp) ? 0b01 : 0b10;
+        }
+        if (inst->mod > mod && inst->mod != 0b11)
+        {
+            mod = inst->mod;
+        }
+
+        buf[i++] = (mod << 6) | (reg << 3) | rm->index;
+        if (mod == 0b01)
+        {
+            buf[i++] = rm->disp & 0xFF;
+        }
+        else if (mod == 0b10)
+        {
+            buf[i++] = rm->disp & 0xFF;
+            buf[i++] = rm->disp >> 8;
+        }
+    }
+
+    return i;
+}
+
+static u8
+encode_data (u8 *buf, u16 data, bool wide)
+{
+    u8 i = 0;
+
+    buf[i++] = data & 0xFF;
+    if (wide)
+    {
+        buf[i++] = data >> 8;
+    }
+
+    return i;
+}
+
+/* writes at most 6 bytes to buf, returns how many were written
+ * (0 if the record can't be encoded) */
+static u8
+encode_instruction (u8 *buf, struct instruction *inst)
+{
+    struct operand *dst = &inst->operands[0];
+    struct operand *src = &inst->operands[1];
+    u8 w = inst->w;
+    u8 i = 0;
+
+    if (inst->op == OP_NONE || dst->mode == IMMEDIATE)
+    {
+        return 0;
+    }
+
+    if (src->mode == IMMEDIATE)
+    {
+        u16 data = src->data;
+
+        if (dst->mode == REGISTER && inst->op == OP_MOV && inst->encoding == ENC_IMM_REG)
+        {
+            buf[i++] = 0b10110000 | (w << 3) | dst->index;
+            i += encode_data (&buf[i], data, w);
+        }
+        else if (dst->mode == REGISTER && dst->index == 0 && inst->op != OP_MOV && inst->encoding == ENC_IMM_ACC)
+        {
+            buf[i++] = encode_imm_acc_opcodes[inst->op] | w;
+            i += encode_data (&buf[i], data, w);
+        }
+        else if (inst->op == OP_MOV)
+        {
+            buf[i++] = 0b11000110 | w;
+            i += encode_modrm (&buf[i], inst, dst, encode_imm_rm_ext[inst->op]);
+            i += encode_data (&buf[i], data, w);
+        }
+        else
+        {
+            /* the sign-extended byte form if the input used it and the
+             * value fits (s with a byte operand changes nothing) */
+            bool s = inst->s && (!w || encode_fits_s8 (data));
+
+            buf[i++] = 0b10000000 | (s << 1) | w;
+            i += encode_modrm (&buf[i], inst, dst, encode_imm_rm_ext[inst->op]);
+            i += encode_data (&buf[i], data, w && !s);
+        }
+    }
+    else
+    {
+        /* one side goes in REG, the other in R/M. Only register to
+         * register leaves a choice */
+        bool d = (dst->mode == REGISTER) && (src->mode != REGISTER || inst->d);
+        struct operand *reg = d ? dst : src;
+        struct operand *rm = d ? src : dst;
+
+        if (reg->mode != REGISTER)
+        {
+            return 0; // memory to memory
+        }
+
+        buf[i++] = encode_rm_reg_opcodes[inst->op] | (d << 1) | w;
+        i += encode_modrm (&buf[i], inst, rm, reg->index);
+    }
+
+    return i;
+}
+
+/* decodes every instruction in data, encodes it again and compares the
+ * result with the input. Reports the first mismatching address. */
+static int
+verify (u8 *data, int len)
+{
+    u64 start = time_now_ns ();
+    u32 count = 0;
+    int i = 0;
+
+    while (i < len)
+    {
+        struct instruction inst;
+        u8 encoded[16];
+
+        u8 decoded_len = decode_instruction (&data[i], &inst);
+        if (decoded_len == 0)
+        {
+            fprintf (stderr, "verify: 0x%05x: no decoder for opcode ["BIN_FMT"]\n", i, BIN_VAL (data[i]));
+            return 1;
+        }
+
+        u8 encoded_len = encode_instruction (encoded, &inst);
+        if (encoded_len != decoded_len ||
+            i + decoded_len > len ||
+            memcmp (encoded, &data[i], decoded_len) != 0)
+        {
+            int n = (decoded_len > encoded_len) ? decoded_len : encoded_len;
+
+            fprintf (stderr, "verify: 0x%05x: mismatch\n", i);
+            fprintf (stderr, "  input:  ");
+            for (int b = 0; b < n && i + b < len; b++)
+            {
+                fprintf (stderr, " %02x", data[i + b]);
+            }
+            fprintf (stderr, "\n  encoded:");
+            for (int b = 0; b < encoded_len; b++)
+            {
+                fprintf (stderr, " %02x", encoded[b]);
+            }
+            fprintf (stderr, "\n  decoded: ");
+
+            FILE *out = fp;
+            fp = stderr;
+            instruction_print (&inst);
+            fp = out;
+
+            return 1;
+        }
+
+        i += decoded_len;
+        count++;
+    }
+
+    double seconds = (double) (time_now_ns () - start) / 1e9;
+
+    printf ("verify: OK, %u instructions, %d bytes (%.2f Minst/s)\n",
+            count, len, seconds > 0 ? ((double) count / 1e6) / seconds : 0.0);
+
+    return 0;
+}
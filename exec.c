@@ -0,0 +1,664 @@
+/**
+ * Execution
+ *
+ * Runs the instructions decode_table covers (mov/add/sub/cmp) on a self
+ * contained machine: registers, flags and 1MB of memory. Programs are
+ * decoded once into a struct program which is read-only while running,
+ * so any number of machines can share it.
+ *
+ * Memory is a table of 4KB pages. A page starts out pointing at shared
+ * read-only data (the input image, or a zero page) and is only copied
+ * into the machine's arena the first time it's written, so a machine
+ * that touches a few pages costs a few pages.
+ *
+ * The program itself isn't mapped into memory, it runs from the
+ * decoded records.
+ */
+
+#define MEMORY_SIZE (1 << 20)
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_COUNT (MEMORY_SIZE / PAGE_SIZE)
+
+enum flag_bits
+{
+    FLAG_CF = 1 << 0,
+    FLAG_PF = 1 << 2,
+    FLAG_AF = 1 << 4,
+    FLAG_ZF = 1 << 6,
+    FLAG_SF = 1 << 7,
+    FLAG_OF = 1 << 11,
+};
+
+enum segment_register
+{
+    SEG_ES,
+    SEG_CS,
+    SEG_SS,
+    SEG_DS,
+};
+
+struct program
+{
+    struct instruction *insts;
+    u32 *offsets;  // byte offset of each instruction
+    u8 *lens;
+    u32 count;
+    u32 len;       // size of the code in bytes
+    u32 *index_at; // instruction index for each byte offset (or PROGRAM_NO_INSTRUCTION)
+};
+
+#define PROGRAM_NO_INSTRUCTION 0xFFFFFFFF
+
+/* ip is 16 bits and must be able to reach the end of the program
+ * without wrapping back to 0 */
+#define PROGRAM_MAX_SIZE 0xFFFF
+
+struct machine
+{
+    u16 regs[8];  // ax cx dx bx sp bp si di, in REG field order
+    u16 sregs[4]; // es cs ss ds
+    u16 ip;
+    u16 flags;
+
+    u8 *pages[PAGE_COUNT];
+    u8 owned[PAGE_COUNT]; // page has been copied and can be written
+
+    struct arena *arena; // where written pages are copied to
+    u8 *image;
+    u32 image_len;
+    u64 steps;
+};
+
+static u8 zero_page[PAGE_SIZE];
+
+static char *flag_names = "C.P.A.ZSTIDO";
+
+static bool
+program_load (struct arena *arena, u8 *code, int len, struct program *program)
+{
+    // every instruction we decode is at least two bytes
+    u32 capacity = (u32) len / 2 + 1;
+    int i = 0;
+
+    if (len > PROGRAM_MAX_SIZE)
+    {
+        fprintf (stderr, "Error: can't execute, the program is %d bytes and ip only reaches %u\n",
+                 len, PROGRAM_MAX_SIZE);
+        return false;
+    }
+
+    *program = (struct program) { .len = (u32) len };
+    program->insts = arena_push_array_nozero (arena, struct instruction, capacity);
+    program->offsets = arena_push_array_nozero (arena, u32, capacity);
+    program->lens = arena_push_array_nozero (arena, u8, capacity);
+    program->index_at = arena_push_array_nozero (arena, u32, len + 1);
+
+    for (int b = 0; b <= len; b++)
+    {
+        program->index_at[b] = PROGRAM_NO_INSTRUCTION;
+    }
+
+    while (i < len)
+    {
+        u32 n = program->count;
+        u8 bytes_consumed = decode_instruction (&code[i], &program->insts[n]);
+
+        if (bytes_consumed == 0)
+        {
+            fprintf (stderr, "Error: can't execute, no decoder for opcode ["BIN_FMT"] at 0x%05x\n",
+                     BIN_VAL (code[i]), i);
+            return false;
+        }
+
+        program->offsets[n] = (u32) i;
+        program->lens[n] = bytes_consumed;
+        program->index_at[i] = n;
+        program->count++;
+        i += bytes_consumed;
+    }
+
+    return true;
+}
+
+/* image is mapped read-only from address 0 and must stay alive while the
+ * machine runs; it needs to be padded to a whole number of pages */
+static void
+machine_init (struct machine *m, struct arena *arena, u8 *image, u32 image_len)
+{
+    *m = (struct machine) { .arena = arena, .image = image, .image_len = image_len };
+
+    for (u32 p = 0; p < PAGE_COUNT; p++)
+    {
+        m->pages[p] = (p * PAGE_SIZE < image_len) ? &image[p * PAGE_SIZE] : zero_page;
+    }
+}
+
+/* back to the state machine_init() left it in, only touching the pages
+ * that were written. The copies are left on the arena for the caller
+ * to pop */
+static void
+machine_reset (struct machine *m)
+{
+    for (u32 p = 0; p < PAGE_COUNT; p++)
+    {
+        if (m->owned[p])
+        {
+            m->pages[p] = (p * PAGE_SIZE < m->image_len) ? &m->image[p * PAGE_SIZE] : zero_page;
+            m->owned[p] = 0;
+        }
+    }
+
+    memset (m->regs, 0, sizeof (m->regs));
+    memset (m->sregs, 0, sizeof (m->sregs));
+    m->ip = 0;
+    m->flags = 0;
+    m->steps = 0;
+}
+
+static u8
+mem_read8 (struct machine *m, u32 addr)
+{
+    addr &= MEMORY_SIZE - 1;
+
+    return m->pages[addr >> PAGE_SHIFT][addr & (PAGE_SIZE - 1)];
+}
+
+static void
+mem_write8 (struct machine *m, u32 addr, u8 value)
+{
+    addr &= MEMORY_SIZE - 1;
+
+    u32 page = addr >> PAGE_SHIFT;
+    if (!m->owned[page])
+    {
+        // copy on first write
+        u8 *copy = arena_push_nozero (m->arena, PAGE_SIZE);
+        memcpy (copy, m->pages[page], PAGE_SIZE);
+        m->pages[page] = copy;
+        m->owned[page] = 1;
+    }
+
+    m->pages[page][addr & (PAGE_SIZE - 1)] = value;
+}
+
+static u16
+mem_read16 (struct machine *m, u32 addr)
+{
+    return mem_read8 (m, addr) | (mem_read8 (m, addr + 1) << 8);
+}
+
+static void
+mem_write16 (struct machine *m, u32 addr, u16 value)
+{
+    mem_write8 (m, addr, value & 0xFF);
+    mem_write8 (m, addr + 1, value >> 8);
+}
+
+static u32
+machine_dirty_pages (struct machine *m)
+{
+    u32 n = 0;
+
+    for (u32 p = 0; p < PAGE_COUNT; p++)
+    {
+        n += m->owned[p];
+    }
+
+    return n;
+}
+
+static u16
+reg_read (struct machine *m, u8 index, u8 w)
+{
+    if (w)
+    {
+        return m->regs[index];
+    }
+
+    // al cl dl bl are the low halves, ah ch dh bh the high
+    return (index < 4) ? (m->regs[index] & 0xFF) : (m->regs[index - 4] >> 8);
+}
+
+static void
+reg_write (struct machine *m, u8 index, u8 w, u16 value)
+{
+    if (w)
+    {
+        m->regs[index] = value;
+    }
+    else if (index < 4)
+    {
+        m->regs[index] = (m->regs[index] & 0xFF00) | (value & 0xFF);
+    }
+    else
+    {
+        m->regs[index - 4] = (m->regs[index - 4] & 0x00FF) | ((value & 0xFF) << 8);
+    }
+}
+
+static u8 eac_base[8][2] = {
+    { 3, 6 }, { 3, 7 }, { 5, 6 }, { 5, 7 }, // bx+si, bx+di, bp+si, bp+di
+    { 6, 8 }, { 7, 8 }, { 5, 8 }, { 3, 8 }, // si, di, bp, bx
+};
+
+/* bp based forms use the stack segment, everything else the data segment */
+static enum segment_register
+operand_segment (struct operand *op)
+{
+    return (op->mode == MEMORY && eac_base[op->index][0] == 5) ? SEG_SS : SEG_DS;
+}
+
+/* physical address of a memory operand */
+static u32
+operand_address (struct machine *m, struct operand *op)
+{
+    u16 ea;
+
+    if (op->mode == DIRECT_ADDRESS)
+    {
+        ea = op->direct_address;
+    }
+    else
+    {
+        u8 base = eac_base[op->index][0];
+        u8 index = eac_base[op->index][1];
+
+        ea = m->regs[base] + (index < 8 ? m->regs[index] : 0) + op->disp;
+    }
+
+    return ((u32) m->sregs[operand_segment (op)] << 4) + ea;
+}
+
+static u16
+operand_read (struct machine *m, struct instruction *inst, struct operand *op)
+{
+    switch (op->mode)
+    {
+        case REGISTER:
+        {
+            return reg_read (m, op->index, inst->w);
+        }
+        case MEMORY:
+        case DIRECT_ADDRESS:
+        {
+            u32 addr = operand_address (m, op);
+            return inst->w ? mem_read16 (m, addr) : mem_read8 (m, addr);
+        }
+        case IMMEDIATE:
+        {
+            return op->data;
+        }
+    }
+
+    return 0;
+}
+
+static void
+operand_write (struct machine *m, struct instruction *inst, struct operand *op, u16 value)
+{
+    switch (op->mode)
+    {
+        case REGISTER:
+        {
+            reg_write (m, op->index, inst->w, value);
+        } break;
+        case MEMORY:
+        case DIRECT_ADDRESS:
+        {
+            u32 addr = operand_address (m, op);
+            if (inst->w)
+            {
+                mem_write16 (m, addr, value);
+            }
+            else
+            {
+                mem_write8 (m, addr, (u8) value);
+            }
+        } break;
+        case IMMEDIATE:
+        {
+            ASSERT (!"can't write to an immediate");
+        } break;
+    }
+}
+
+static bool
+parity (u8 value)
+{
+    value ^= value >> 4;
+    value ^= value >> 2;
+    value ^= value >> 1;
+
+    return (value & 1) == 0;
+}
+
+/* the arithmetic flags of dst + src (or dst - src) = result */
+static u16
+arith_flags (u32 dst, u32 src, u32 result, bool subtract, u8 w)
+{
+    u32 sign = w ? 0x8000 : 0x80;
+    u32 mask = w ? 0xFFFF : 0xFF;
+    u16 flags = 0;
+
+    if (result & (mask + 1))                 flags |= FLAG_CF;
+    if (parity (result & 0xFF))              flags |= FLAG_PF;
+    if ((dst ^ src ^ result) & 0x10)         flags |= FLAG_AF;
+    if ((result & mask) == 0)                flags |= FLAG_ZF;
+    if (result & sign)                       flags |= FLAG_SF;
+
+    // overflow: the operands' signs say the result sign is impossible
+    u32 src_sign = subtract ? (src ^ sign) : src;
+    if (((dst ^ result) & (src_sign ^ result)) & sign)
+    {
+        flags |= FLAG_OF;
+    }
+
+    return flags;
+}
+
+#define ARITH_FLAGS (FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF | FLAG_OF)
+
+static void
+exec_instruction (struct machine *m, struct instruction *inst)
+{
+    struct operand *dst = &inst->operands[0];
+    struct operand *src = &inst->operands[1];
+
+    switch (inst->op)
+    {
+        case OP_MOV:
+        {
+            operand_write (m, inst, dst, operand_read (m, inst, src));
+        } break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_CMP:
+        {
+            u32 a = operand_read (m, inst, dst);
+            u32 b = operand_read (m, inst, src);
+            bool subtract = inst->op != OP_ADD;
+            u32 result = subtract ? (a - b) : (a + b);
+
+            m->flags = (m->flags & ~ARITH_FLAGS) | arith_flags (a, b, result, subtract, inst->w);
+            if (inst->op != OP_CMP)
+            {
+                operand_write (m, inst, dst, (u16) result);
+            }
+        } break;
+        case OP_NONE:
+        {
+        } break;
+    }
+}
+
+/* runs until ip leaves the program, returns false if it lands in the
+ * middle of an instruction */
+static bool
+machine_run (struct machine *m, struct program *program)
+{
+    while (m->ip < program->len)
+    {
+        u32 n = program->index_at[m->ip];
+        if (n == PROGRAM_NO_INSTRUCTION)
+        {
+            return false;
+        }
+
+        m->ip += program->lens[n];
+        exec_instruction (m, &program->insts[n]);
+        m->steps++;
+    }
+
+    return true;
+}
+
+static char *
+flags_string (char *buf, u16 flags)
+{
+    char *ptr = buf;
+
+    for (int bit = 0; bit < 12; bit++)
+    {
+        if ((flags & (1 << bit)) && flag_names[bit] != '.')
+        {
+            *ptr++ = flag_names[bit];
+        }
+    }
+    *ptr = 0;
+
+    return buf;
+}
+
+static void
+machine_print (FILE *out, struct machine *m)
+{
+    char flags[16];
+
+    fprintf (out, "Final registers:\n");
+    for (int r = 0; r < 8; r++)
+    {
+        fprintf (out, "      %s: 0x%04x (%u)\n", registers[r][1], m->regs[r], m->regs[r]);
+    }
+    fprintf (out, "      ip: 0x%04x (%u)\n", m->ip, m->ip);
+    fprintf (out, "   flags: %s\n", flags_string (flags, m->flags));
+}
+
+static void
+machine_dump_print (FILE *out, struct machine *m, u32 addr, u32 len)
+{
+    if (len)
+    {
+        fprintf (out, "  0x%05x: ", addr);
+        for (u32 i = 0; i < len; i++)
+        {
+            fprintf (out, "%02x", mem_read8 (m, addr + i));
+        }
+        fprintf (out, "\n");
+    }
+}
+
+/* reads a memory image on to the arena with read_file(), *image_len is
+ * padded to a whole number of pages. Images over 1MB are refused */
+static u8 *
+image_load (struct arena *arena, char *file, u32 *image_len, char **error)
+{
+    u8 *image = read_file (arena, file, MEMORY_SIZE, PAGE_SIZE, image_len, error);
+
+    *image_len = (*image_len + PAGE_SIZE - 1) & ~(u32) (PAGE_SIZE - 1);
+
+    return image;
+}
+
+/**
+ * Batch execution
+ *
+ * Runs one program against many memory images on the thread pool. The
+ * program is shared read-only, each worker has its own arena which is
+ * popped back after every instance.
+ */
+
+#define EXEC_WORKER_ARENA_SIZE (64ull << 20)
+
+struct exec_result
+{
+    bool loaded;
+    char *error; // why it wasn't
+    bool ok;
+    u16 regs[8];
+    u16 ip;
+    u16 flags;
+    u32 dirty_pages;
+    u64 steps;
+};
+
+struct exec_batch
+{
+    struct program *program;
+    char **images;
+    struct arena *arenas; // one per worker
+    struct exec_result *results;
+
+    u32 dump_addr;
+    u32 dump_len;
+    u8 *dumps; // dump_len bytes per image
+};
+
+static void
+exec_batch_task (void *context, u32 worker, u32 index)
+{
+    struct exec_batch *batch = context;
+    struct arena *arena = &batch->arenas[worker];
+    struct arena_mark mark = arena_mark (arena);
+    struct exec_result *result = &batch->results[index];
+    struct machine m;
+    u32 image_len = 0;
+
+    u8 *image = image_load (arena, batch->images[index], &image_len, &result->error);
+    if (image)
+    {
+        result->loaded = true;
+        machine_init (&m, arena, image, image_len);
+        result->ok = machine_run (&m, batch->program);
+
+        memcpy (result->regs, m.regs, sizeof (m.regs));
+        result->ip = m.ip;
+        result->flags = m.flags;
+        result->dirty_pages = machine_dirty_pages (&m);
+        result->steps = m.steps;
+
+        for (u32 i = 0; i < batch->dump_len; i++)
+        {
+            batch->dumps[(u64) index * batch->dump_len + i] = mem_read8 (&m, batch->dump_addr + i);
+        }
+    }
+
+    arena_pop_to (mark);
+}
+
+static void
+exec_dump_print (FILE *out, u8 *bytes, u32 len)
+{
+    for (u32 i = 0; i < len; i++)
+    {
+        fprintf (out, "%02x", bytes[i]);
+    }
+}
+
+/* arenas that were never set up are still zero, releasing those is fine */
+static void
+exec_batch_release (struct exec_batch *batch, u32 worker_count)
+{
+    for (u32 w = 0; w < worker_count; w++)
+    {
+        arena_release (&batch->arenas[w]);
+    }
+}
+
+static int
+exec_batch_run (struct arena *arena, struct program *program, char **images, u32 count,
+                u32 thread_count, u32 dump_addr, u32 dump_len)
+{
+    struct arena_mark mark = arena_mark (arena);
+    u32 worker_count = pool_worker_count (thread_count);
+    struct exec_batch batch = {
+        .program = program,
+        .images = images,
+        .dump_addr = dump_addr,
+        .dump_len = dump_len,
+    };
+    int ret = 0;
+
+    // every dump is kept until the results are printed in order
+    if (!arena_fits (arena, (u64) count * dump_len + (u64) count * sizeof (struct exec_result)))
+    {
+        fprintf (stderr, "Error: --dump of %u bytes for %u images doesn't fit in memory\n", dump_len, count);
+        return 1;
+    }
+
+    batch.arenas = arena_push_array (arena, struct arena, worker_count);
+    batch.results = arena_push_array (arena, struct exec_result, count);
+    batch.dumps = arena_push (arena, (u64) count * dump_len);
+
+    for (u32 w = 0; w < worker_count; w++)
+    {
+        if (!arena_init (&batch.arenas[w], EXEC_WORKER_ARENA_SIZE))
+        {
+            fprintf (stderr, "Error: Could not reserve memory\n");
+            exec_batch_release (&batch, worker_count);
+            arena_pop_to (mark);
+            return 1;
+        }
+    }
+
+    u64 start = time_now_ns ();
+    pool_run (arena, worker_count, count, exec_batch_task, &batch);
+    u64 elapsed = time_now_ns () - start;
+
+    u64 steps = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+        struct exec_result *result = &batch.results[i];
+        char flags[16];
+
+        fprintf (fp, "%s:", images[i]);
+        if (!result->loaded)
+        {
+            fprintf (fp, " error: could not read image: %s\n", result->error);
+            ret = 1;
+            continue;
+        }
+
+        for (int r = 0; r < 8; r++)
+        {
+            fprintf (fp, " %s=%04x", registers[r][1], result->regs[r]);
+        }
+        fprintf (fp, " flags=%s dirty=%u", flags_string (flags, result->flags), result->dirty_pages);
+        if (dump_len)
+        {
+            fprintf (fp, " mem=");
+            exec_dump_print (fp, &batch.dumps[(u64) i * dump_len], dump_len);
+        }
+        if (!result->ok)
+        {
+            fprintf (fp, " error: ip 0x%04x is not the start of an instruction", result->ip);
+            ret = 1;
+        }
+        fprintf (fp, "\n");
+
+        steps += result->steps;
+    }
+
+    double seconds = (double) elapsed / 1e9;
+    fprintf (stderr, "run: %u instances, %llu instructions, %u threads, %.3fs (%.0f instances/s)\n",
+             count, (unsigned long long) steps, worker_count, seconds,
+             seconds > 0 ? count / seconds : 0.0);
+
+    exec_batch_release (&batch, worker_count);
+    arena_pop_to (mark);
+
+    return ret;
+}
+
+/* runs the program once on empty memory and prints the final state */
+static int
+exec_single_run (struct arena *arena, struct program *program, u32 dump_addr, u32 dump_len)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct machine m;
+    int ret = 0;
+
+    machine_init (&m, arena, NULL, 0);
+    if (!machine_run (&m, program))
+    {
+        fprintf (stderr, "Error: ip 0x%04x is not the start of an instruction\n", m.ip);
+        ret = 1;
+    }
+
+    machine_print (fp, &m);
+    machine_dump_print (fp, &m, dump_addr, dump_len);
+
+    arena_pop_to (mark);
+
+    return ret;
+}
@@ -0,0 +1,501 @@
+/**
+ * Output formats
+ *
+ * Every syntax (--syntax nasm|masm|att|json) is one function that
+ * writes an instruction straight into the shared output buffer and
+ * returns the new end. Each caller reserves room for a whole line up
+ * front, so the writers never check for space and nothing is built in
+ * a temporary string first. The buffer goes to fp when it fills up,
+ * and whoever writes to it flushes before returning, so the output
+ * stays in order with plain fprintf (fp, ...) calls. The buffer and the
+ * chosen syntax are per thread, like fp.
+ *
+ *   nasm  mov word [bx + si + 4], ax
+ *   masm  mov word ptr [bx+si+4], ax
+ *   att   movw %ax, 4(%bx,%si)
+ *   json  {"offset":0,"len":3,"op":"mov","w":1,"dst":{"mem":{"base":"bx","index":"si","disp":4}},"src":{"reg":"ax"}}
+ *         {"offset":3,"error":"unknown opcode","byte":15}
+ */
+
+#define FORMAT_MAX_LINE 256
+
+struct output
+{
+    u8 *data;
+    u32 used;
+    u32 size;
+};
+
+static u8 output_default[4 * FORMAT_MAX_LINE];
+static THREAD_LOCAL struct output output = { output_default, 0, sizeof (output_default) };
+
+static void
+output_flush (void)
+{
+    if (output.used)
+    {
+        fwrite (output.data, 1, output.used, fp);
+        output.used = 0;
+    }
+}
+
+/* a bigger buffer than the built in one, size must be at least FORMAT_MAX_LINE */
+static void
+output_set_buffer (u8 *data, u32 size)
+{
+    output_flush ();
+    output.data = data;
+    output.size = size;
+}
+
+/* where to write the next len bytes. Commit them with output_commit() */
+static u8 *
+output_reserve (u32 len)
+{
+    if (output.used + len > output.size)
+    {
+        output_flush ();
+    }
+
+    return &output.data[output.used];
+}
+
+static void
+output_commit (u8 *end)
+{
+    output.used = (u32) (end - output.data);
+}
+
+static u8 *
+put_str (u8 *p, char *s)
+{
+    while (*s)
+    {
+        *p++ = (u8) *s++;
+    }
+
+    return p;
+}
+
+static u8 *
+put_u32 (u8 *p, u32 value)
+{
+    u8 digits[10];
+    int n = 0;
+
+    do
+    {
+        digits[n++] = (u8) ('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    while (n)
+    {
+        *p++ = digits[--n];
+    }
+
+    return p;
+}
+
+static u8 *
+put_s32 (u8 *p, s32 value)
+{
+    if (value < 0)
+    {
+        *p++ = '-';
+        return put_u32 (p, (u32) -value);
+    }
+
+    return put_u32 (p, (u32) value);
+}
+
+/* lowercase, zero padded to digits */
+static u8 *
+put_hex (u8 *p, u32 value, int digits)
+{
+    for (int i = digits - 1; i >= 0; i--)
+    {
+        *p++ = (u8) "0123456789abcdef"[(value >> (i * 4)) & 0xF];
+    }
+
+    return p;
+}
+
+/* digits for offsets into an input of len bytes: 5, or 8 once it goes
+ * past 1MB so the offsets don't wrap */
+static int
+offset_digits (u32 len)
+{
+    return len > 0x100000 ? 8 : 5;
+}
+
+/* "00" .. "ff", two characters per byte value */
+static char hex_pairs[] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/* listing prefix: offset, then the encoded bytes in a column as wide as
+ * the longest instruction. digits is 5 or 8 (see offset_digits()) */
+#define LISTING_BYTES 6
+#define LISTING_BYTES_WIDTH (2 + LISTING_BYTES * 3 + 1)
+
+static u8 *
+put_listing (u8 *p, u32 offset, int digits, u8 *bytes, u8 len)
+{
+    if (digits == 8)
+    {
+        memcpy (&p[0], &hex_pairs[(offset >> 24) * 2], 2);
+        memcpy (&p[2], &hex_pairs[((offset >> 16) & 0xFF) * 2], 2);
+        p += 4;
+    }
+    else
+    {
+        *p++ = (u8) "0123456789abcdef"[(offset >> 16) & 0xF];
+    }
+    memcpy (&p[0], &hex_pairs[((offset >> 8) & 0xFF) * 2], 2);
+    memcpy (&p[2], &hex_pairs[(offset & 0xFF) * 2], 2);
+    p += 4;
+
+    memset (p, ' ', LISTING_BYTES_WIDTH);
+    for (u8 i = 0; i < len && i < LISTING_BYTES; i++)
+    {
+        memcpy (&p[2 + i * 3], &hex_pairs[bytes[i] * 2], 2);
+    }
+
+    return p + LISTING_BYTES_WIDTH;
+}
+
+/* the registers of each R/M effective address, index is NULL when there's only a base */
+static char *eac_base_names[] = { "bx", "bx", "bp", "bp", "si", "di", "bp", "bx" };
+static char *eac_index_names[] = { "si", "di", "si", "di", NULL, NULL, NULL, NULL };
+
+static char *width_names[] = { "byte", "word" };
+
+typedef u8 *(format_f) (u8 *p, struct instruction *inst, u32 offset, u8 len);
+
+static u8 *
+format_nasm (u8 *p, struct instruction *inst, u32 offset, u8 len)
+{
+    char *separators[2] = { ", ", "\n" };
+
+    p = put_str (p, inst->name);
+    *p++ = ' ';
+    for (int i = 0; i < 2; i++)
+    {
+        struct operand *op = &inst->operands[i];
+        s16 disp = (s16) op->disp;
+
+        switch (op->mode)
+        {
+            case REGISTER:
+            {
+                p = put_str (p, op->value);
+            } break;
+            case MEMORY:
+            {
+                p = put_str (p, width_names[inst->w]);
+                p = put_str (p, " [");
+                p = put_str (p, op->value);
+                if (disp > 0)
+                {
+                    p = put_str (p, " + ");
+                    p = put_s32 (p, disp);
+                }
+                else if (disp < 0)
+                {
+                    p = put_str (p, " - ");
+                    p = put_s32 (p, -disp);
+                }
+                *p++ = ']';
+            } break;
+            case IMMEDIATE:
+            {
+                p = put_s32 (p, (s16) op->data);
+            } break;
+            case DIRECT_ADDRESS:
+            {
+                p = put_str (p, width_names[inst->w]);
+                p = put_str (p, " [");
+                p = put_u32 (p, op->direct_address);
+                *p++ = ']';
+            } break;
+        }
+
+        p = put_str (p, separators[i]);
+    }
+
+    return p;
+}
+
+static u8 *
+format_masm (u8 *p, struct instruction *inst, u32 offset, u8 len)
+{
+    char *separators[2] = { ", ", "\n" };
+
+    p = put_str (p, inst->name);
+    *p++ = ' ';
+    for (int i = 0; i < 2; i++)
+    {
+        struct operand *op = &inst->operands[i];
+        s16 disp = (s16) op->disp;
+
+        switch (op->mode)
+        {
+            case REGISTER:
+            {
+                p = put_str (p, op->value);
+            } break;
+            case MEMORY:
+            {
+                p = put_str (p, width_names[inst->w]);
+                p = put_str (p, " ptr [");
+                p = put_str (p, eac_base_names[op->index]);
+                if (eac_index_names[op->index])
+                {
+                    *p++ = '+';
+                    p = put_str (p, eac_index_names[op->index]);
+                }
+                if (disp > 0)
+                {
+                    *p++ = '+';
+                }
+                if (disp != 0)
+                {
+                    p = put_s32 (p, disp);
+                }
+                *p++ = ']';
+            } break;
+            case IMMEDIATE:
+            {
+                p = put_s32 (p, (s16) op->data);
+            } break;
+            case DIRECT_ADDRESS:
+            {
+                p = put_str (p, width_names[inst->w]);
+                p = put_str (p, " ptr ds:[");
+                p = put_u32 (p, op->direct_address);
+                *p++ = ']';
+            } break;
+        }
+
+        p = put_str (p, separators[i]);
+    }
+
+    return p;
+}
+
+/* source first, % on registers, $ on immediates, size in the mnemonic */
+static u8 *
+format_att (u8 *p, struct instruction *inst, u32 offset, u8 len)
+{
+    char *separators[2] = { "\n", ", " };
+
+    p = put_str (p, inst->name);
+    *p++ = inst->w ? 'w' : 'b';
+    *p++ = ' ';
+    for (int i = 1; i >= 0; i--)
+    {
+        struct operand *op = &inst->operands[i];
+
+        switch (op->mode)
+        {
+            case REGISTER:
+            {
+                *p++ = '%';
+                p = put_str (p, op->value);
+            } break;
+            case MEMORY:
+            {
+                if (op->disp)
+                {
+                    p = put_s32 (p, (s16) op->disp);
+                }
+                p = put_str (p, "(%");
+                p = put_str (p, eac_base_names[op->index]);
+                if (eac_index_names[op->index])
+                {
+                    p = put_str (p, ",%");
+                    p = put_str (p, eac_index_names[op->index]);
+                }
+                *p++ = ')';
+            } break;
+            case IMMEDIATE:
+            {
+                *p++ = '$';
+                p = put_s32 (p, (s16) op->data);
+            } break;
+            case DIRECT_ADDRESS:
+            {
+                p = put_u32 (p, op->direct_address);
+            } break;
+        }
+
+        p = put_str (p, separators[i]);
+    }
+
+    return p;
+}
+
+static u8 *
+format_json_operand (u8 *p, struct operand *op)
+{
+    switch (op->mode)
+    {
+        case REGISTER:
+        {
+            p = put_str (p, "{\"reg\":\"");
+            p = put_str (p, op->value);
+            p = put_str (p, "\"}");
+        } break;
+        case MEMORY:
+        {
+            p = put_str (p, "{\"mem\":{\"base\":\"");
+            p = put_str (p, eac_base_names[op->index]);
+            if (eac_index_names[op->index])
+            {
+                p = put_str (p, "\",\"index\":\"");
+                p = put_str (p, eac_index_names[op->index]);
+            }
+            p = put_str (p, "\",\"disp\":");
+            p = put_s32 (p, (s16) op->disp);
+            p = put_str (p, "}}");
+        } break;
+        case IMMEDIATE:
+        {
+            p = put_str (p, "{\"imm\":");
+            p = put_s32 (p, (s16) op->data);
+            *p++ = '}';
+        } break;
+        case DIRECT_ADDRESS:
+        {
+            p = put_str (p, "{\"addr\":");
+            p = put_u32 (p, op->direct_address);
+            *p++ = '}';
+        } break;
+    }
+
+    return p;
+}
+
+static u8 *
+format_json (u8 *p, struct instruction *inst, u32 offset, u8 len)
+{
+    p = put_str (p, "{\"offset\":");
+    p = put_u32 (p, offset);
+    p = put_str (p, ",\"len\":");
+    p = put_u32 (p, len);
+    p = put_str (p, ",\"op\":\"");
+    p = put_str (p, inst->name);
+    p = put_str (p, "\",\"w\":");
+    *p++ = (u8) ('0' + inst->w);
+    p = put_str (p, ",\"dst\":");
+    p = format_json_operand (p, &inst->operands[0]);
+    p = put_str (p, ",\"src\":");
+    p = format_json_operand (p, &inst->operands[1]);
+    p = put_str (p, "}\n");
+
+    return p;
+}
+
+enum syntax
+{
+    SYNTAX_NASM,
+    SYNTAX_MASM,
+    SYNTAX_ATT,
+    SYNTAX_JSON,
+};
+
+struct format
+{
+    char *name;
+    char *header;        // once at the top of a disassembly
+    format_f *instruction;
+    bool has_offset;     // records carry their own offset, listings don't prefix one
+};
+
+static struct format formats[] = {
+    [SYNTAX_NASM] = { "nasm", "; disassembly\n\nbits 16\n\n", format_nasm, false },
+    [SYNTAX_MASM] = { "masm", "; disassembly\n\n.8086\n\n", format_masm, false },
+    [SYNTAX_ATT]  = { "att", "# disassembly\n\n.code16\n\n", format_att, false },
+    [SYNTAX_JSON] = { "json", "", format_json, true },
+};
+
+/* the syntax chosen with --syntax */
+static THREAD_LOCAL struct format *format = &formats[SYNTAX_NASM];
+
+/* --listing: offset and bytes in front of every instruction */
+static THREAD_LOCAL bool format_listing;
+
+/* hex digits of the offsets in front of instructions, offset_digits()
+ * of the input being printed */
+static THREAD_LOCAL int format_offset_digits = 5;
+
+static struct format *
+format_find (char *name)
+{
+    for (u32 i = 0; i < ARRAY_COUNT (formats); i++)
+    {
+        if (strcmp (formats[i].name, name) == 0)
+        {
+            return &formats[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+format_header (void)
+{
+    output_commit (put_str (output_reserve (FORMAT_MAX_LINE), format->header));
+}
+
+/* in the --syntax format, into the output buffer. bytes is the
+ * encoding, for --listing */
+static void
+format_instruction (struct instruction *inst, u32 offset, u8 *bytes, u8 len)
+{
+    u8 *p = output_reserve (FORMAT_MAX_LINE);
+
+    if (format_listing)
+    {
+        p = put_listing (p, offset, format_offset_digits, bytes, len);
+    }
+
+    output_commit (format->instruction (p, inst, offset, len));
+}
+
+/* the byte where decoding stopped. Formats with records get an error
+ * record so the stream stays parseable, the others a plain line */
+static void
+format_unknown (u32 offset, u8 byte)
+{
+    if (format->has_offset)
+    {
+        u8 *p = output_reserve (FORMAT_MAX_LINE);
+        p = put_str (p, "{\"offset\":");
+        p = put_u32 (p, offset);
+        p = put_str (p, ",\"error\":\"unknown opcode\",\"byte\":");
+        p = put_u32 (p, byte);
+        output_commit (put_str (p, "}\n"));
+    }
+    else
+    {
+        output_flush ();
+        fprintf (fp, "decode function for ["BIN_FMT"] not found\n", BIN_VAL (byte));
+    }
+}
+
+/* one instruction in NASM syntax to fp, for messages and reports */
+static void
+instruction_print (struct instruction *inst)
+{
+    output_commit (format_nasm (output_reserve (FORMAT_MAX_LINE), inst, 0, 0));
+    output_flush ();
+}
@@ -0,0 +1,701 @@
+/**
+ * Lane-parallel execution
+ *
+ * Runs one program over many independent inputs at once by keeping
+ * LANES machine states side by side in vector registers: regs[r] holds
+ * register r of every lane. Register and immediate operands and the
+ * mov/add/sub/cmp arithmetic (flags included) are single vector ops;
+ * memory operands fall back to a per-lane gather/scatter through each
+ * lane's own copy-on-write memory.
+ *
+ * 16 lanes with AVX2 ("build.sh avx2"), 8 with SSE2, and a plain C
+ * version of the same vector ops everywhere else. --lanes-check runs
+ * whichever one was built against exec.c.
+ *
+ * Nothing the decoder handles transfers control, so every lane runs the
+ * same instruction stream and the lanes never diverge. Branches would
+ * need an active mask per lane and to split the group where lanes
+ * disagree.
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LANES 16
+
+typedef __m256i vec;
+
+static vec vec_set1 (u16 x)          { return _mm256_set1_epi16 ((short) x); }
+static vec vec_load (u16 *p)         { return _mm256_loadu_si256 ((__m256i *) p); }
+static void vec_store (u16 *p, vec a) { _mm256_storeu_si256 ((__m256i *) p, a); }
+static vec vec_add (vec a, vec b)    { return _mm256_add_epi16 (a, b); }
+static vec vec_sub (vec a, vec b)    { return _mm256_sub_epi16 (a, b); }
+static vec vec_and (vec a, vec b)    { return _mm256_and_si256 (a, b); }
+static vec vec_or (vec a, vec b)     { return _mm256_or_si256 (a, b); }
+static vec vec_xor (vec a, vec b)    { return _mm256_xor_si256 (a, b); }
+static vec vec_shl (vec a, int n)    { return _mm256_slli_epi16 (a, n); }
+static vec vec_shr (vec a, int n)    { return _mm256_srli_epi16 (a, n); }
+static vec vec_eq (vec a, vec b)     { return _mm256_cmpeq_epi16 (a, b); }
+
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LANES 8
+
+typedef __m128i vec;
+
+static vec vec_set1 (u16 x)          { return _mm_set1_epi16 ((short) x); }
+static vec vec_load (u16 *p)         { return _mm_loadu_si128 ((__m128i *) p); }
+static void vec_store (u16 *p, vec a) { _mm_storeu_si128 ((__m128i *) p, a); }
+static vec vec_add (vec a, vec b)    { return _mm_add_epi16 (a, b); }
+static vec vec_sub (vec a, vec b)    { return _mm_sub_epi16 (a, b); }
+static vec vec_and (vec a, vec b)    { return _mm_and_si128 (a, b); }
+static vec vec_or (vec a, vec b)     { return _mm_or_si128 (a, b); }
+static vec vec_xor (vec a, vec b)    { return _mm_xor_si128 (a, b); }
+static vec vec_shl (vec a, int n)    { return _mm_slli_epi16 (a, n); }
+static vec vec_shr (vec a, int n)    { return _mm_srli_epi16 (a, n); }
+static vec vec_eq (vec a, vec b)     { return _mm_cmpeq_epi16 (a, b); }
+
+#else
+#define LANES 8
+
+typedef struct { u16 v[LANES]; } vec;
+
+#define VEC_OP(NAME, EXPR) \
+    static vec NAME (vec a, vec b) { vec r; for (int i = 0; i < LANES; i++) r.v[i] = (u16) (EXPR); return r; }
+
+static vec vec_set1 (u16 x)          { vec r; for (int i = 0; i < LANES; i++) r.v[i] = x; return r; }
+static vec vec_load (u16 *p)         { vec r; memcpy (r.v, p, sizeof (r.v)); return r; }
+static void vec_store (u16 *p, vec a) { memcpy (p, a.v, sizeof (a.v)); }
+VEC_OP (vec_add, a.v[i] + b.v[i])
+VEC_OP (vec_sub, a.v[i] - b.v[i])
+VEC_OP (vec_and, a.v[i] & b.v[i])
+VEC_OP (vec_or,  a.v[i] | b.v[i])
+VEC_OP (vec_xor, a.v[i] ^ b.v[i])
+VEC_OP (vec_eq,  a.v[i] == b.v[i] ? 0xFFFF : 0)
+static vec vec_shl (vec a, int n)    { vec r; for (int i = 0; i < LANES; i++) r.v[i] = (u16) (a.v[i] << n); return r; }
+static vec vec_shr (vec a, int n)    { vec r; for (int i = 0; i < LANES; i++) r.v[i] = (u16) (a.v[i] >> n); return r; }
+
+#endif
+
+/* 0 or 1 in every lane, from a lane mask of 0 or 0xFFFF */
+static vec
+vec_bit (vec mask)
+{
+    return vec_shr (mask, 15);
+}
+
+/* 1 where the bit is set */
+static vec
+vec_test (vec a, u16 bit)
+{
+    vec zero = vec_set1 (0);
+
+    return vec_xor (vec_bit (vec_eq (vec_and (a, vec_set1 (bit)), zero)), vec_set1 (1));
+}
+
+struct lanes
+{
+    vec regs[8];
+    vec flags;
+
+    bool uses_memory;
+    struct machine mem[LANES]; // only the memory of each lane is used
+};
+
+/* the arena only aligns to 16 bytes, AVX2 vectors want 32 */
+static struct lanes *
+lanes_alloc (struct arena *arena)
+{
+    u8 *p = arena_push (arena, sizeof (struct lanes) + sizeof (vec));
+    u64 align = sizeof (vec);
+
+    return (struct lanes *) (((u64) p + (align - 1)) & ~(align - 1));
+}
+
+/* scalar copy of every lane's registers, for computing addresses */
+static void
+lanes_address (struct lanes *l, struct operand *op, u32 *addr)
+{
+    u16 regs[8][LANES];
+    struct machine tmp;
+
+    for (int r = 0; r < 8; r++)
+    {
+        vec_store (regs[r], l->regs[r]);
+    }
+
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        for (int r = 0; r < 8; r++)
+        {
+            tmp.regs[r] = regs[r][lane];
+        }
+        memset (tmp.sregs, 0, sizeof (tmp.sregs));
+        addr[lane] = operand_address (&tmp, op);
+    }
+}
+
+static vec
+lanes_read (struct lanes *l, struct instruction *inst, struct operand *op)
+{
+    switch (op->mode)
+    {
+        case REGISTER:
+        {
+            if (inst->w)
+            {
+                return l->regs[op->index];
+            }
+
+            return (op->index < 4) ? vec_and (l->regs[op->index], vec_set1 (0xFF)) : vec_shr (l->regs[op->index - 4], 8);
+        }
+        case MEMORY:
+        case DIRECT_ADDRESS:
+        {
+            u32 addr[LANES];
+            u16 values[LANES];
+
+            lanes_address (l, op, addr);
+            for (int lane = 0; lane < LANES; lane++)
+            {
+                struct machine *m = &l->mem[lane];
+                values[lane] = inst->w ? mem_read16 (m, addr[lane]) : mem_read8 (m, addr[lane]);
+            }
+
+            return vec_load (values);
+        }
+        case IMMEDIATE:
+        {
+            return vec_set1 (op->data);
+        }
+    }
+
+    return vec_set1 (0);
+}
+
+static void
+lanes_write (struct lanes *l, struct instruction *inst, struct operand *op, vec value)
+{
+    switch (op->mode)
+    {
+        case REGISTER:
+        {
+            u8 r = op->index;
+
+            if (inst->w)
+            {
+                l->regs[r] = value;
+            }
+            else if (r < 4)
+            {
+                l->regs[r] = vec_or (vec_and (l->regs[r], vec_set1 (0xFF00)), vec_and (value, vec_set1 (0xFF)));
+            }
+            else
+            {
+                l->regs[r - 4] = vec_or (vec_and (l->regs[r - 4], vec_set1 (0x00FF)), vec_shl (value, 8));
+            }
+        } break;
+        case MEMORY:
+        case DIRECT_ADDRESS:
+        {
+            u32 addr[LANES];
+            u16 values[LANES];
+
+            lanes_address (l, op, addr);
+            vec_store (values, value);
+            for (int lane = 0; lane < LANES; lane++)
+            {
+                struct machine *m = &l->mem[lane];
+                if (inst->w)
+                {
+                    mem_write16 (m, addr[lane], values[lane]);
+                }
+                else
+                {
+                    mem_write8 (m, addr[lane], (u8) values[lane]);
+                }
+            }
+        } break;
+        case IMMEDIATE:
+        {
+            ASSERT (!"can't write to an immediate");
+        } break;
+    }
+}
+
+/* vector version of arith_flags(), a and b are zero-extended to 16 bits */
+static vec
+lanes_arith_flags (vec a, vec b, vec r, bool subtract, u8 w)
+{
+    u16 sign = w ? 0x8000 : 0x80;
+    u16 mask = w ? 0xFFFF : 0xFF;
+    vec zero = vec_set1 (0);
+    vec cf;
+
+    if (!w)
+    {
+        // byte results don't wrap in 16 bits, the carry is bit 8
+        cf = vec_test (r, 0x100);
+    }
+    else if (!subtract)
+    {
+        // carry out of bit 15: (a & b) | ((a | b) & ~r)
+        vec carry = vec_or (vec_and (a, b), vec_and (vec_or (a, b), vec_xor (r, vec_set1 (0xFFFF))));
+        cf = vec_shr (carry, 15);
+    }
+    else
+    {
+        // borrow out of bit 15: (~a & b) | (~(a ^ b) & r)
+        vec not_a = vec_xor (a, vec_set1 (0xFFFF));
+        vec borrow = vec_or (vec_and (not_a, b), vec_and (vec_xor (vec_xor (a, b), vec_set1 (0xFFFF)), r));
+        cf = vec_shr (borrow, 15);
+    }
+
+    vec p = vec_and (r, vec_set1 (0xFF));
+    p = vec_xor (p, vec_shr (p, 4));
+    p = vec_xor (p, vec_shr (p, 2));
+    p = vec_xor (p, vec_shr (p, 1));
+    vec pf = vec_xor (vec_and (p, vec_set1 (1)), vec_set1 (1));
+
+    vec af = vec_test (vec_xor (vec_xor (a, b), r), 0x10);
+    vec zf = vec_bit (vec_eq (vec_and (r, vec_set1 (mask)), zero));
+    vec sf = vec_test (r, sign);
+
+    vec b_sign = subtract ? vec_xor (b, vec_set1 (sign)) : b;
+    vec of = vec_test (vec_and (vec_xor (a, r), vec_xor (b_sign, r)), sign);
+
+    vec flags = cf;
+    flags = vec_or (flags, vec_shl (pf, 2));
+    flags = vec_or (flags, vec_shl (af, 4));
+    flags = vec_or (flags, vec_shl (zf, 6));
+    flags = vec_or (flags, vec_shl (sf, 7));
+    flags = vec_or (flags, vec_shl (of, 11));
+
+    return flags;
+}
+
+static void
+lanes_exec (struct lanes *l, struct instruction *inst)
+{
+    struct operand *dst = &inst->operands[0];
+    struct operand *src = &inst->operands[1];
+
+    switch (inst->op)
+    {
+        case OP_MOV:
+        {
+            lanes_write (l, inst, dst, lanes_read (l, inst, src));
+        } break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_CMP:
+        {
+            vec a = lanes_read (l, inst, dst);
+            vec b = lanes_read (l, inst, src);
+            bool subtract = inst->op != OP_ADD;
+            vec r = subtract ? vec_sub (a, b) : vec_add (a, b);
+
+            vec keep = vec_and (l->flags, vec_set1 ((u16) ~ARITH_FLAGS));
+            l->flags = vec_or (keep, lanes_arith_flags (a, b, r, subtract, inst->w));
+            if (inst->op != OP_CMP)
+            {
+                lanes_write (l, inst, dst, r);
+            }
+        } break;
+        case OP_NONE:
+        {
+        } break;
+    }
+}
+
+/**
+ * Brute-force search
+ *
+ * Runs the program once for every value of one register in a range
+ * (the other registers fixed) and prints the inputs whose final
+ * registers match every wanted value.
+ */
+
+#define SEARCH_MAX_REGS 8
+
+struct search
+{
+    u8 vary;                      // register index that takes every value in [from, to]
+    u32 from;
+    u32 to;
+    u16 set[8];                   // initial value of the other registers
+    u8 want_count;
+    u8 want_reg[SEARCH_MAX_REGS];
+    u16 want_value[SEARCH_MAX_REGS];
+    bool scalar;                  // use exec.c one input at a time instead
+};
+
+static bool
+program_uses_memory (struct program *program)
+{
+    for (u32 n = 0; n < program->count; n++)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            enum op_mode mode = program->insts[n].operands[i].mode;
+            if (mode == MEMORY || mode == DIRECT_ADDRESS)
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static u32
+search_lanes (struct arena *arena, struct program *program, struct search *search)
+{
+    struct lanes *l = lanes_alloc (arena);
+    struct arena_mark mark;
+    u32 matches = 0;
+
+    l->uses_memory = program_uses_memory (program);
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        machine_init (&l->mem[lane], arena, NULL, 0);
+    }
+    mark = arena_mark (arena);
+
+    for (u32 base = search->from; base <= search->to; base += LANES)
+    {
+        u16 inputs[LANES];
+        u16 match[LANES];
+
+        for (int lane = 0; lane < LANES; lane++)
+        {
+            inputs[lane] = (u16) (base + lane);
+        }
+        for (int r = 0; r < 8; r++)
+        {
+            l->regs[r] = vec_set1 (search->set[r]);
+        }
+        l->regs[search->vary] = vec_load (inputs);
+        l->flags = vec_set1 (0);
+
+        for (u32 n = 0; n < program->count; n++)
+        {
+            lanes_exec (l, &program->insts[n]);
+        }
+
+        vec all = vec_set1 (0xFFFF);
+        for (int i = 0; i < search->want_count; i++)
+        {
+            all = vec_and (all, vec_eq (l->regs[search->want_reg[i]], vec_set1 (search->want_value[i])));
+        }
+        vec_store (match, all);
+
+        for (int lane = 0; lane < LANES && base + lane <= search->to; lane++)
+        {
+            if (match[lane])
+            {
+                fprintf (fp, "%s=0x%04x\n", registers[search->vary][1], inputs[lane]);
+                matches++;
+            }
+        }
+
+        if (l->uses_memory)
+        {
+            for (int lane = 0; lane < LANES; lane++)
+            {
+                machine_reset (&l->mem[lane]);
+            }
+            arena_pop_to (mark);
+        }
+    }
+
+    return matches;
+}
+
+static u32
+search_scalar (struct arena *arena, struct program *program, struct search *search)
+{
+    struct machine *m = arena_push (arena, sizeof (*m));
+    struct arena_mark mark;
+    u32 matches = 0;
+
+    machine_init (m, arena, NULL, 0);
+    mark = arena_mark (arena);
+
+    for (u32 value = search->from; value <= search->to; value++)
+    {
+        bool match = true;
+
+        machine_reset (m);
+        memcpy (m->regs, search->set, sizeof (m->regs));
+        m->regs[search->vary] = (u16) value;
+        machine_run (m, program);
+
+        for (int i = 0; i < search->want_count; i++)
+        {
+            match &= m->regs[search->want_reg[i]] == search->want_value[i];
+        }
+
+        if (match)
+        {
+            fprintf (fp, "%s=0x%04x\n", registers[search->vary][1], value);
+            matches++;
+        }
+
+        arena_pop_to (mark);
+    }
+
+    return matches;
+}
+
+static int
+search_run (struct arena *arena, struct program *program, struct search *search)
+{
+    struct arena_mark mark = arena_mark (arena);
+    u64 start = time_now_ns ();
+
+    u32 matches = search->scalar ? search_scalar (arena, program, search) : search_lanes (arena, program, search);
+
+    double seconds = (double) (time_now_ns () - start) / 1e9;
+    u64 inputs = (u64) search->to - search->from + 1;
+
+    fprintf (stderr, "search: %u of %llu inputs matched, %s, %.3fs (%.1f M inputs/s)\n",
+             matches, (unsigned long long) inputs,
+             search->scalar ? "scalar" : (LANES == 16 ? "16 lanes" : "8 lanes"),
+             seconds, seconds > 0 ? ((double) inputs / 1e6) / seconds : 0.0);
+
+    arena_pop_to (mark);
+
+    return 0;
+}
+
+/* "ax" .. "di" to a register index */
+static bool
+search_parse_reg (char *name, size_t len, u8 *index)
+{
+    for (u8 r = 0; r < 8; r++)
+    {
+        if (len == 2 && strncmp (name, registers[r][1], 2) == 0)
+        {
+            *index = r;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* "dx=0x1234" */
+static bool
+search_parse_assign (char *arg, u8 *index, u16 *value)
+{
+    char *eq = strchr (arg, '=');
+
+    if (!eq || !search_parse_reg (arg, eq - arg, index))
+    {
+        return false;
+    }
+
+    *value = (u16) strtoul (eq + 1, NULL, 0);
+
+    return true;
+}
+
+/**
+ * Lane self-check
+ *
+ * Checks the vector code against exec.c: lanes_arith_flags() against
+ * arith_flags() for every byte add/sub and a sample of word ones, then
+ * random programs from the bench generator run in every lane against
+ * the same inputs run one at a time (registers, flags and memory).
+ */
+
+#define LANES_CHECK_MAX_FAILURES 16
+#define LANES_CHECK_WORD_PAIRS   (1 << 20)
+#define LANES_CHECK_PROGRAMS     256
+
+struct lanes_check
+{
+    u64 cases;
+    u32 failure_count;
+    u32 pending;              // cases queued in a, b
+    u16 a[LANES];
+    u16 b[LANES];
+};
+
+/* runs the queued flag cases as one vector */
+static void
+lanes_check_flags_flush (struct lanes_check *check, bool subtract, u8 w)
+{
+    u16 got[LANES];
+    vec a = vec_load (check->a);
+    vec b = vec_load (check->b);
+    vec r = subtract ? vec_sub (a, b) : vec_add (a, b);
+
+    vec_store (got, lanes_arith_flags (a, b, r, subtract, w));
+
+    for (u32 lane = 0; lane < check->pending; lane++)
+    {
+        u32 x = check->a[lane];
+        u32 y = check->b[lane];
+        u16 want = arith_flags (x, y, subtract ? x - y : x + y, subtract, w);
+
+        if (got[lane] != want && check->failure_count++ < LANES_CHECK_MAX_FAILURES)
+        {
+            fprintf (stderr, "lanes: FAIL %s w=%u 0x%04x, 0x%04x: flags 0x%04x, want 0x%04x\n",
+                     subtract ? "sub" : "add", w, x, y, got[lane], want);
+        }
+    }
+
+    check->cases += check->pending;
+    check->pending = 0;
+}
+
+static void
+lanes_check_flags (struct lanes_check *check, u16 a, u16 b, bool subtract, u8 w)
+{
+    check->a[check->pending] = a;
+    check->b[check->pending] = b;
+    if (++check->pending == LANES)
+    {
+        lanes_check_flags_flush (check, subtract, w);
+    }
+}
+
+static void
+lanes_check_program (struct lanes_check *check, struct arena *arena, u64 seed)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct bench_config config = bench_defaults;
+    struct lanes *l = lanes_alloc (arena);
+    struct machine *m = arena_push (arena, sizeof (*m));
+    struct program program;
+    u16 inputs[8][LANES];
+    u16 regs[8][LANES];
+    u16 flags[LANES];
+    u64 rng = seed;
+
+    config.bytes = 64;
+    config.seed = seed;
+
+    u8 *code = arena_push (arena, config.bytes + 16);
+    u32 len = gen_corpus (code, config.bytes, &config);
+
+    if (!program_load (arena, code, (int) len, &program))
+    {
+        check->failure_count++;
+        fprintf (stderr, "lanes: FAIL program 0x%llx doesn't decode\n", (unsigned long long) seed);
+        arena_pop_to (mark);
+        return;
+    }
+
+    for (int r = 0; r < 8; r++)
+    {
+        for (int lane = 0; lane < LANES; lane++)
+        {
+            inputs[r][lane] = (u16) rng_next (&rng);
+        }
+        l->regs[r] = vec_load (inputs[r]);
+    }
+    l->flags = vec_set1 (0);
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        machine_init (&l->mem[lane], arena, NULL, 0);
+    }
+
+    for (u32 n = 0; n < program.count; n++)
+    {
+        lanes_exec (l, &program.insts[n]);
+    }
+
+    for (int r = 0; r < 8; r++)
+    {
+        vec_store (regs[r], l->regs[r]);
+    }
+    vec_store (flags, l->flags);
+
+    machine_init (m, arena, NULL, 0);
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        bool same = true;
+
+        machine_reset (m);
+        for (int r = 0; r < 8; r++)
+        {
+            m->regs[r] = inputs[r][lane];
+        }
+        machine_run (m, &program);
+
+        for (int r = 0; r < 8; r++)
+        {
+            same &= regs[r][lane] == m->regs[r];
+        }
+        same &= flags[lane] == m->flags;
+        for (u32 p = 0; p < PAGE_COUNT; p++)
+        {
+            if (m->owned[p] || l->mem[lane].owned[p])
+            {
+                same &= memcmp (m->pages[p], l->mem[lane].pages[p], PAGE_SIZE) == 0;
+            }
+        }
+
+        check->cases++;
+        if (!same && check->failure_count++ < LANES_CHECK_MAX_FAILURES)
+        {
+            fprintf (stderr, "lanes: FAIL program 0x%llx lane %d:", (unsigned long long) seed, lane);
+            for (int r = 0; r < 8; r++)
+            {
+                fprintf (stderr, " %s=%04x/%04x", registers[r][1], regs[r][lane], m->regs[r]);
+            }
+            fprintf (stderr, " flags=%04x/%04x\n", flags[lane], m->flags);
+        }
+    }
+
+    arena_pop_to (mark);
+}
+
+static int
+lanes_check_run (struct arena *arena)
+{
+    struct lanes_check check = { 0 };
+    u64 start = time_now_ns ();
+    u64 rng = 0x8086;
+
+    for (int subtract = 0; subtract < 2; subtract++)
+    {
+        for (u32 a = 0; a < 0x100; a++)
+        {
+            for (u32 b = 0; b < 0x100; b++)
+            {
+                lanes_check_flags (&check, (u16) a, (u16) b, subtract, 0);
+            }
+        }
+        lanes_check_flags_flush (&check, subtract, 0);
+
+        for (u32 i = 0; i < ARRAY_COUNT (sweep_values_16); i++)
+        {
+            for (u32 j = 0; j < ARRAY_COUNT (sweep_values_16); j++)
+            {
+                lanes_check_flags (&check, sweep_values_16[i], sweep_values_16[j], subtract, 1);
+            }
+        }
+        for (u32 i = 0; i < LANES_CHECK_WORD_PAIRS; i++)
+        {
+            u64 x = rng_next (&rng);
+            lanes_check_flags (&check, (u16) x, (u16) (x >> 16), subtract, 1);
+        }
+        lanes_check_flags_flush (&check, subtract, 1);
+    }
+
+    for (u64 seed = 1; seed <= LANES_CHECK_PROGRAMS; seed++)
+    {
+        lanes_check_program (&check, arena, seed);
+    }
+
+    double seconds = (double) (time_now_ns () - start) / 1e9;
+
+    printf ("lanes: %s, %llu cases, %u failures, %d lanes, %.3fs\n",
+            check.failure_count ? "FAILED" : "OK", (unsigned long long) check.cases,
+            check.failure_count, LANES, seconds);
+
+    return check.failure_count ? 1 : 0;
+}
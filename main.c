@@ -2,8 +2,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 #define ASSERT(EXPR) if (!(EXPR)) { fprintf (stderr, "Assert failed [%s():%d]: if (%s) ..\n", __func__, __LINE__, #EXPR); *(volatile int *) 0 = 0; }
+#define ARRAY_COUNT(A) (sizeof (A) / sizeof ((A)[0]))
+#define ARENA_RESERVE_SIZE (1ull << 30)
+#define OUTPUT_BUFFER_SIZE (1 << 20)
 #define BIN_FMT "%d%d%d%d %d%d%d%d"
 #define BIN_VAL(BYTE) \
     (BYTE & (1 << 7) ? 1 : 0), \
@@ -18,9 +23,34 @@
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 typedef int8_t s8;
 typedef int16_t s16;
 typedef int32_t s32;
+typedef int64_t s64;
+
+#include "platform.c"
+#include "arena.c"
+
+enum op_type
+{
+    OP_NONE,
+    OP_MOV,
+    OP_ADD,
+    OP_SUB,
+    OP_CMP
+};
+
+/* which of the opcode forms an instruction was decoded from,
+ * needed to encode it back to the exact same bytes */
+enum encoding
+{
+    ENC_NONE,
+    ENC_RM_REG,  // reg/memory with register
+    ENC_IMM_RM,  // immediate to reg/memory
+    ENC_IMM_REG, // immediate to register
+    ENC_IMM_ACC  // immediate to accumulator
+};
 
 enum op_mode
 {
@@ -34,6 +64,7 @@ struct operand
 {
     char *value;
     enum op_mode mode;
+    u8 index; // register index, or the R/M field for memory operands
     u16 disp;
     u16 data;
     u16 direct_address;
@@ -42,6 +73,8 @@ struct operand
 struct instruction
 {
     char *name; // TODO: static buffer?
+    enum op_type op;
+    enum encoding encoding;
 
     /* width
      *
@@ -88,7 +121,7 @@ struct instruction
     struct operand operands[2];
 };
 
-static FILE *fp;
+static THREAD_LOCAL FILE *fp; // per thread, so server workers can each write their own reply
 static char *registers[][2] = {
     [0b000] = { "al", "ax" },
     [0b001] = { "cl", "cx" },
@@ -110,53 +143,7 @@ static char *eac_table[] = {
     [0b111] = "bx",
 };
 
-static void
-instruction_print (struct instruction *inst)
-{
-    char *separators[2] = { ", ", "\n" };
-
-    fprintf (fp, "%s ", inst->name);
-    for (int i = 0; i < 2; i++)
-    {
-        struct operand *op = &inst->operands[i];
-
-        if (op->mode == REGISTER)
-        {
-            fprintf (fp, "%s", op->value);
-        }
-        else if (op->mode == MEMORY)
-        {
-            if (inst->w)
-            {
-                fprintf (fp, "word ");
-            }
-            else
-            {
-                fprintf (fp, "byte ");
-            }
-
-            fprintf (fp, "[%s", op->value);
-            if (op->disp)
-            {
-                // fprintf (fp, " + %d", (s16) op->disp);
-                fprintf (fp, " + %d", op->disp);
-            }
-            fprintf (fp, "]");
-        }
-        else if (op->mode == IMMEDIATE)
-        {
-            ASSERT (op->data);
-
-            fprintf (fp, "%d", (s16) op->data);
-        }
-        else if (op->mode == DIRECT_ADDRESS)
-        {
-            fprintf (fp, "word [%d]", (s16) op->direct_address);
-        }
-
-        fprintf (fp, "%s", separators[i]);
-    }
-}
+#include "format.c"
 
 static u8
 decode_displacement (u8 *buf, struct instruction *inst)
@@ -184,16 +171,11 @@ decode_displacement (u8 *buf, struct instruction *inst)
             /**
              * Memory mode, 8-bit displacement follows
              */
-            inst->disp = buf[i++];
-            // TODO: do we need to sign-extend?
             // Page 4-20:
             // If the displacement is only a single byte, the 8086
             // or 8088 automatically sign-extends this quantity to 16-bits
             // before using the information in further address calculations.
-//            if (inst->disp)
-//            {
-//                inst->disp |= 0xFF << 8;
-//            }
+            inst->disp = (u16) (s16) (s8) buf[i++];
         } break;
         case 0b10:
         {
@@ -215,6 +197,26 @@ decode_displacement (u8 *buf, struct instruction *inst)
     return i;
 }
 
+/* reads the immediate data of the "immediate to reg/memory" forms:
+ * 16-bit if w=1 (unless s=1, then an 8-bit value is sign-extended) */
+static u8
+decode_data (u8 *buf, struct instruction *inst, u16 *data)
+{
+    u8 i = 0;
+
+    *data = buf[i++];
+    if (inst->w == 1 && inst->s == 0)
+    {
+        *data |= buf[i++] << 8;
+    }
+    else if (inst->w == 1 && inst->s == 1)
+    {
+        *data = (u16) (s16) (s8) *data;
+    }
+
+    return i;
+}
+
 static void
 operand_set (struct instruction *inst, struct operand *op, u8 mode, u8 register_index)
 {
@@ -222,10 +224,12 @@ operand_set (struct instruction *inst, struct operand *op, u8 mode, u8 register_
     if (op->mode == REGISTER)
     {
         op->value = registers[register_index][inst->w];
+        op->index = register_index;
     }
     else if (op->mode == MEMORY)
     {
         op->value = eac_table[inst->rm];
+        op->index = inst->rm;
 
         if (inst->disp)
         {
@@ -251,23 +255,19 @@ decode_operands (struct instruction *inst)
         case 0b01:
         case 0b10:
         {
-            u8 dst_mode;
-            u8 src_mode = inst->d ? MEMORY : REGISTER;
-            u8 register_index = inst->reg;
+            u8 mem_mode = MEMORY;
 
             if (inst->mod == 0b00 &&
                 inst->rm == 0b110)
             {
-                dst_mode = DIRECT_ADDRESS;
-                register_index = 0;
-            }
-            else
-            {
-                dst_mode = inst->d ? REGISTER : MEMORY;
+                mem_mode = DIRECT_ADDRESS;
             }
 
-            operand_set (inst, &inst->operands[0], dst_mode, register_index);
-            operand_set (inst, &inst->operands[1], src_mode, register_index);
+            u8 dst_mode = inst->d ? REGISTER : mem_mode;
+            u8 src_mode = inst->d ? mem_mode : REGISTER;
+
+            operand_set (inst, &inst->operands[0], dst_mode, inst->reg);
+            operand_set (inst, &inst->operands[1], src_mode, inst->reg);
         } break;
         case 0b11:
         {
@@ -317,10 +317,12 @@ decode_operands (struct instruction *inst)
  */
 
 static u8
-decode_mov_rm2r (u8 *buf)
+decode_mov_rm2r (u8 *buf, struct instruction *inst)
 {
     u8 i = 0;
-    struct instruction inst = { .name = "mov" };
+    inst->name = "mov";
+    inst->op = OP_MOV;
+    inst->encoding = ENC_RM_REG;
     u8 b0 = buf[i++];
     u8 b1 = buf[i++];
 
@@ -328,83 +330,115 @@ decode_mov_rm2r (u8 *buf)
 
 //    printf ("DEBUG: decoding mov (reg/mem-to/from-reg)\n");
 
-    inst.d = (b0 & 0b00000010) >> 1;
-    inst.w = (b0 & 0b00000001);
+    inst->d = (b0 & 0b00000010) >> 1;
+    inst->w = (b0 & 0b00000001);
 
-    inst.mod = (b1 & 0b11000000) >> 6;
-    inst.reg = (b1 & 0b00111000) >> 3;
-    inst.rm  = (b1 & 0b00000111);
+    inst->mod = (b1 & 0b11000000) >> 6;
+    inst->reg = (b1 & 0b00111000) >> 3;
+    inst->rm  = (b1 & 0b00000111);
 
 //    printf ("DEBUG: "BIN_FMT", "BIN_FMT"\n", BIN_VAL (b0), BIN_VAL (b1));
 
-    i += decode_displacement (&buf[i], &inst);
-    inst.disp = (s16) inst.disp; // sign-extension
-    decode_operands (&inst);
+    i += decode_displacement (&buf[i], inst);
+    decode_operands (inst);
 
 //    printf ("DEBUG: d=%d w=%d mod="BIN_FMT" reg="BIN_FMT" rm="BIN_FMT"\n",
-//            inst.d, inst.w, BIN_VAL (inst.mod), BIN_VAL (inst.reg), BIN_VAL (inst.rm));
-
-    instruction_print (&inst);
+//            inst->d, inst->w, BIN_VAL (inst->mod), BIN_VAL (inst->reg), BIN_VAL (inst->rm));
 
     return i;
 }
 
 static u8
-decode_mov_i2rm (u8 *buf)
+decode_mov_i2rm (u8 *buf, struct instruction *inst)
 {
-    printf ("ERROR-not-implemented: decoding mov (immediate-to-reg/mem)\n");
-    return 0;
-}
+    inst->name = "mov";
+    inst->op = OP_MOV;
+    inst->encoding = ENC_IMM_RM;
+    u8 i = 0;
+
+    u8 b0 = buf[i++];
+    u8 b1 = buf[i++];
+
+    ASSERT ((b0 >> 1) == 0b1100011);
 
+    inst->w = (b0 & 0b01) != 0; // 0000 0001
+
+    inst->mod = (b1 >> 6) & 0b11;  // 1100 0000
+    inst->reg = (b1 >> 3) & 0b111; // 0011 1000
+    inst->rm = b1 & 0b111;         // 0000 0111
+
+    if (inst->reg != 0b000)
+    {
+        // REG must be 000 for this form
+        return 0;
+    }
+
+    i += decode_displacement (&buf[i], inst);
+    decode_operands (inst);
+
+    struct operand *src = &inst->operands[1];
+    src->mode = IMMEDIATE;
+    i += decode_data (&buf[i], inst, &src->data);
+
+    return i;
+}
 
 static u8
-decode_mov_i2r (u8 *buf)
+decode_mov_i2r (u8 *buf, struct instruction *inst)
 {
+    inst->name = "mov";
+    inst->op = OP_MOV;
+    inst->encoding = ENC_IMM_REG;
     u8 i = 0;
     u8 b0 = buf[i++];
 
-    u8 W   = (b0 & 0b1000) >> 3;
-    u8 REG = (b0 & 0b0111);
-    u16 data = buf[i++];
+    inst->w   = (b0 & 0b1000) >> 3;
+    inst->reg = (b0 & 0b0111);
+
+    struct operand *dst = &inst->operands[0];
+    operand_set (inst, dst, REGISTER, inst->reg);
 
-    if (W == 1)
+    struct operand *src = &inst->operands[1];
+    src->mode = IMMEDIATE;
+    src->data = buf[i++];
+    if (inst->w == 1)
     {
-        data |= buf[i++] << 8;
+        src->data |= buf[i++] << 8;
     }
 
-    fprintf (fp, "mov %s, %u\n", registers[REG][W], data);
-
     return i;
 }
 
 
 static u8
-decode_add_r2r (u8 *buf)
+decode_add_r2r (u8 *buf, struct instruction *inst)
 {
-    struct instruction inst = { .name = "add" };
+    inst->name = "add";
+    inst->op = OP_ADD;
+    inst->encoding = ENC_RM_REG;
     u8 i = 0;
     u8 b0 = buf[i++];
     u8 b1 = buf[i++];
 
-    inst.d = (b0 & 0b10) != 0; // 0000 0010
-    inst.w = (b0 & 0b01) != 0; // 0000 0001
-
-    inst.mod = (b1 >> 6) & 0b11;  // 1100 0000
-    inst.reg = (b1 >> 3) & 0b111; // 0011 1000
-    inst.rm = b1 & 0b111;         // 0000 0111
+    inst->d = (b0 & 0b10) != 0; // 0000 0010
+    inst->w = (b0 & 0b01) != 0; // 0000 0001
 
-    i += decode_displacement (&buf[i], &inst);
-    decode_operands (&inst);
+    inst->mod = (b1 >> 6) & 0b11;  // 1100 0000
+    inst->reg = (b1 >> 3) & 0b111; // 0011 1000
+    inst->rm = b1 & 0b111;         // 0000 0111
 
-    instruction_print (&inst);
+    i += decode_displacement (&buf[i], inst);
+    decode_operands (inst);
 
     return i;
 }
 
 static u8
-decode_add_i2rm (u8 *buf)
+decode_add_i2rm (u8 *buf, struct instruction *inst)
 {
-    struct instruction inst = { .name = "add" };
+    inst->name = "add";
+    inst->op = OP_ADD;
+    inst->encoding = ENC_IMM_RM;
     u8 i = 0;
 
 //    printf ("DEBUG: decoding add (immediate-to-reg/memory)\n");
@@ -412,38 +446,34 @@ decode_add_i2rm (u8 *buf)
     u8 b0 = buf[i++];
     u8 b1 = buf[i++];
 
-    inst.s = (b0 & 0b10) != 0; // 0000 0010
-    inst.w = (b0 & 0b01) != 0; // 0000 0001
+    inst->s = (b0 & 0b10) != 0; // 0000 0010
+    inst->w = (b0 & 0b01) != 0; // 0000 0001
 
-    inst.mod = (b1 >> 6) & 0b11;  // 1100 0000
-    inst.reg = (b1 >> 3) & 0b111; // 0011 1000
-    inst.rm = b1 & 0b111;         // 0000 0111
+    inst->mod = (b1 >> 6) & 0b11;  // 1100 0000
+    inst->reg = (b1 >> 3) & 0b111; // 0011 1000
+    inst->rm = b1 & 0b111;         // 0000 0111
 
 //    printf ("DEBUG: "BIN_FMT", "BIN_FMT"\n", BIN_VAL (b0), BIN_VAL (b1));
 
-    i += decode_displacement (&buf[i], &inst);
-    decode_operands (&inst);
+    i += decode_displacement (&buf[i], inst);
+    decode_operands (inst);
 
-    struct operand *src = &inst.operands[1];
+    struct operand *src = &inst->operands[1];
     src->mode = IMMEDIATE;
-    src->data = buf[i++];
-    if (inst.s == 0 && inst.w == 1)
-    {
-        src->data |= 0xFF << 8; // TODO: should be buf[i++] << 8
-    }
+    i += decode_data (&buf[i], inst, &src->data);
 //    printf ("DEBUG: d=%d w=%d mod="BIN_FMT" reg="BIN_FMT" rm="BIN_FMT"\n",
-//            inst.d, inst.w, BIN_VAL (inst.mod), BIN_VAL (inst.reg), BIN_VAL (inst.rm));
-
-    instruction_print (&inst);
+//            inst->d, inst->w, BIN_VAL (inst->mod), BIN_VAL (inst->reg), BIN_VAL (inst->rm));
 
     return i;
 }
 
 
 static u8
-decode_add_i2a (u8 *buf)
+decode_add_i2a (u8 *buf, struct instruction *inst)
 {
-    struct instruction inst = { .name = "add" };
+    inst->name = "add";
+    inst->op = OP_ADD;
+    inst->encoding = ENC_IMM_ACC;
     u8 i = 0;
 
 //    printf ("DEBUG: decoding add (immediate-to-accumulator)\n");
@@ -452,30 +482,30 @@ decode_add_i2a (u8 *buf)
 
     ASSERT ((b0 >> 1) == 0b0000010);
 
-    inst.w = (b0 & 0b01) != 0; // 0000 0001
-    i += decode_displacement (&buf[i], &inst);
+    inst->w = (b0 & 0b01) != 0; // 0000 0001
+    i += decode_displacement (&buf[i], inst);
 
-    struct operand *dst = &inst.operands[0];
-    dst->value = registers[0][inst.w];
+    struct operand *dst = &inst->operands[0];
+    dst->value = registers[0][inst->w];
     dst->mode = REGISTER;
 
-    struct operand *src = &inst.operands[1];
+    struct operand *src = &inst->operands[1];
     src->mode = IMMEDIATE;
     src->data = buf[i++];
-    if (inst.w)
+    if (inst->w)
     {
         src->data |= buf[i++] << 8;
     }
 
-    instruction_print (&inst);
-
     return i;
 }
 
 static u8
-decode_sub_r2r (u8 *buf)
+decode_sub_r2r (u8 *buf, struct instruction *inst)
 {
-    struct instruction inst = { .name = "sub" };
+    inst->name = "sub";
+    inst->op = OP_SUB;
+    inst->encoding = ENC_RM_REG;
     u8 i = 0;
 
     u8 b0 = buf[i++];
@@ -485,30 +515,30 @@ decode_sub_r2r (u8 *buf)
 
 //    printf ("DEBUG: decoding sub (reg/mem to either)\n");
 
-    inst.d = (b0 & 0b00000010) >> 1;
-    inst.w = (b0 & 0b00000001);
+    inst->d = (b0 & 0b00000010) >> 1;
+    inst->w = (b0 & 0b00000001);
 
-    inst.mod = (b1 & 0b11000000) >> 6;
-    inst.reg = (b1 & 0b00111000) >> 3;
-    inst.rm  = (b1 & 0b00000111);
+    inst->mod = (b1 & 0b11000000) >> 6;
+    inst->reg = (b1 & 0b00111000) >> 3;
+    inst->rm  = (b1 & 0b00000111);
 
 //    printf ("DEBUG: "BIN_FMT", "BIN_FMT"\n", BIN_VAL (b0), BIN_VAL (b1));
 
-    i += decode_displacement (&buf[i], &inst);
-    decode_operands (&inst);
+    i += decode_displacement (&buf[i], inst);
+    decode_operands (inst);
 
 //    printf ("DEBUG: d=%d w=%d mod="BIN_FMT" reg="BIN_FMT" rm="BIN_FMT"\n",
-//            inst.d, inst.w, BIN_VAL (inst.mod), BIN_VAL (inst.reg), BIN_VAL (inst.rm));
-
-    instruction_print (&inst);
+//            inst->d, inst->w, BIN_VAL (inst->mod), BIN_VAL (inst->reg), BIN_VAL (inst->rm));
 
     return i;
 }
 
 static u8
-decode_sub_ifrm (u8 *buf)
+decode_sub_ifrm (u8 *buf, struct instruction *inst)
 {
-    struct instruction inst = { .name = "sub" };
+    inst->name = "sub";
+    inst->op = OP_SUB;
+    inst->encoding = ENC_IMM_RM;
     u8 i = 0;
 
 //    printf ("DEBUG: decoding sub (immediate from reg/memory)\n");
@@ -516,37 +546,33 @@ decode_sub_ifrm (u8 *buf)
     u8 b0 = buf[i++];
     u8 b1 = buf[i++];
 
-    inst.s = (b0 & 0b10) != 0; // 0000 0010
-    inst.w = (b0 & 0b01) != 0; // 0000 0001
+    inst->s = (b0 & 0b10) != 0; // 0000 0010
+    inst->w = (b0 & 0b01) != 0; // 0000 0001
 
-    inst.mod = (b1 >> 6) & 0b11;  // 1100 0000
-    inst.reg = (b1 >> 3) & 0b111; // 0011 1000
-    inst.rm = b1 & 0b111;         // 0000 0111
+    inst->mod = (b1 >> 6) & 0b11;  // 1100 0000
+    inst->reg = (b1 >> 3) & 0b111; // 0011 1000
+    inst->rm = b1 & 0b111;         // 0000 0111
 
 //    printf ("DEBUG: "BIN_FMT", "BIN_FMT"\n", BIN_VAL (b0), BIN_VAL (b1));
 
-    i += decode_displacement (&buf[i], &inst);
-    decode_operands (&inst);
+    i += decode_displacement (&buf[i], inst);
+    decode_operands (inst);
 
-    struct operand *src = &inst.operands[1];
+    struct operand *src = &inst->operands[1];
     src->mode = IMMEDIATE;
-    src->data = buf[i++];
-    if (inst.s == 0 && inst.w == 1)
-    {
-        src->data |= 0xFF << 8; // TODO: should be buf[i++] << 8
-    }
+    i += decode_data (&buf[i], inst, &src->data);
 //    printf ("DEBUG: d=%d w=%d mod="BIN_FMT" reg="BIN_FMT" rm="BIN_FMT"\n",
-//            inst.d, inst.w, BIN_VAL (inst.mod), BIN_VAL (inst.reg), BIN_VAL (inst.rm));
-
-    instruction_print (&inst);
+//            inst->d, inst->w, BIN_VAL (inst->mod), BIN_VAL (inst->reg), BIN_VAL (inst->rm));
 
     return i;
 }
 
 static u8
-decode_sub_ifa (u8 *buf)
+decode_sub_ifa (u8 *buf, struct instruction *inst)
 {
-    struct instruction inst = { .name = "sub" };
+    inst->name = "sub";
+    inst->op = OP_SUB;
+    inst->encoding = ENC_IMM_ACC;
     u8 i = 0;
 
 //    printf ("DEBUG: decoding sub (immediate from accumulator)\n");
@@ -555,30 +581,30 @@ decode_sub_ifa (u8 *buf)
 
     ASSERT ((b0 >> 1) == 0b0010110);
 
-    inst.w = (b0 & 0b01) != 0; // 0000 0001
-    i += decode_displacement (&buf[i], &inst);
+    inst->w = (b0 & 0b01) != 0; // 0000 0001
+    i += decode_displacement (&buf[i], inst);
 
-    struct operand *dst = &inst.operands[0];
-    dst->value = registers[0][inst.w];
+    struct operand *dst = &inst->operands[0];
+    dst->value = registers[0][inst->w];
     dst->mode = REGISTER;
 
-    struct operand *src = &inst.operands[1];
+    struct operand *src = &inst->operands[1];
     src->mode = IMMEDIATE;
     src->data = buf[i++];
-    if (inst.w)
+    if (inst->w)
     {
         src->data |= buf[i++] << 8;
     }
 
-    instruction_print (&inst);
-
     return i;
 }
 
 static u8
-decode_cmp_rmnr (u8 *buf)
+decode_cmp_rmnr (u8 *buf, struct instruction *inst)
 {
-    struct instruction inst = { .name = "cmp" };
+    inst->name = "cmp";
+    inst->op = OP_CMP;
+    inst->encoding = ENC_RM_REG;
     u8 i = 0;
 
 //    printf ("%s\n", __func__);
@@ -590,28 +616,28 @@ decode_cmp_rmnr (u8 *buf)
 
 //    printf ("DEBUG: "BIN_FMT", "BIN_FMT"\n", BIN_VAL (b0), BIN_VAL (b1));
 
-    inst.d = (b0 & 0b00000010) >> 1;
-    inst.w = (b0 & 0b00000001);
+    inst->d = (b0 & 0b00000010) >> 1;
+    inst->w = (b0 & 0b00000001);
 
-    inst.mod = (b1 & 0b11000000) >> 6;
-    inst.reg = (b1 & 0b00111000) >> 3;
-    inst.rm  = (b1 & 0b00000111);
+    inst->mod = (b1 & 0b11000000) >> 6;
+    inst->reg = (b1 & 0b00111000) >> 3;
+    inst->rm  = (b1 & 0b00000111);
 
 //    printf ("DEBUG: d=%d w=%d mod="BIN_FMT" reg="BIN_FMT" rm="BIN_FMT"\n",
-//            inst.d, inst.w, BIN_VAL (inst.mod), BIN_VAL (inst.reg), BIN_VAL (inst.rm));
+//            inst->d, inst->w, BIN_VAL (inst->mod), BIN_VAL (inst->reg), BIN_VAL (inst->rm));
 
-    i += decode_displacement (&buf[i], &inst);
-    decode_operands (&inst);
-
-    instruction_print (&inst);
+    i += decode_displacement (&buf[i], inst);
+    decode_operands (inst);
 
     return i;
 }
 
 static u8
-decode_cmp_iwrm (u8 *buf)
+decode_cmp_iwrm (u8 *buf, struct instruction *inst)
 {
-    struct instruction inst = { .name = "cmp" };
+    inst->name = "cmp";
+    inst->op = OP_CMP;
+    inst->encoding = ENC_IMM_RM;
     u8 i = 0;
 
 //    printf ("%s\n", __func__);
@@ -621,47 +647,40 @@ decode_cmp_iwrm (u8 *buf)
 
     ASSERT ((b0 >> 2) == 0b100000);
 
-    inst.s = (b0 & 0b10) != 0; // 0000 0010
-    inst.w = (b0 & 0b01) != 0; // 0000 0001
+    inst->s = (b0 & 0b10) != 0; // 0000 0010
+    inst->w = (b0 & 0b01) != 0; // 0000 0001
 
-    inst.mod = (b1 >> 6) & 0b11;  // 1100 0000
-    inst.reg = (b1 >> 3) & 0b111; // 0011 1000
-    inst.rm = b1 & 0b111;         // 0000 0111
+    inst->mod = (b1 >> 6) & 0b11;  // 1100 0000
+    inst->reg = (b1 >> 3) & 0b111; // 0011 1000
+    inst->rm = b1 & 0b111;         // 0000 0111
 
 //    printf ("DEBUG: "BIN_FMT", "BIN_FMT"\n", BIN_VAL (b0), BIN_VAL (b1));
 //    printf ("DEBUG: s=%d w=%d mod="BIN_FMT" reg="BIN_FMT" rm="BIN_FMT"\n",
-//            inst.s, inst.w, BIN_VAL (inst.mod), BIN_VAL (inst.reg), BIN_VAL (inst.rm));
-
-    i += decode_displacement (&buf[i], &inst);
+//            inst->s, inst->w, BIN_VAL (inst->mod), BIN_VAL (inst->reg), BIN_VAL (inst->rm));
 
-//    printf ("DEBUG:  disp="BIN_FMT"  "BIN_FMT"\n", BIN_VAL ((inst.disp >> 8)), BIN_VAL ((inst.disp & 0xFF)));
-//    printf ("DEBUG:  disp=%u %d %d %d\n", inst.disp, inst.disp, (s8) inst.disp, (s16) inst.disp);
+    i += decode_displacement (&buf[i], inst);
 
-    // expect: cmp ax, 1000
-    // actual: cmp (null), 232
+//    printf ("DEBUG:  disp="BIN_FMT"  "BIN_FMT"\n", BIN_VAL ((inst->disp >> 8)), BIN_VAL ((inst->disp & 0xFF)));
+//    printf ("DEBUG:  disp=%u %d %d %d\n", inst->disp, inst->disp, (s8) inst->disp, (s16) inst->disp);
 
-    decode_operands (&inst);
+    decode_operands (inst);
 
-    struct operand *src = &inst.operands[1];
+    struct operand *src = &inst->operands[1];
     src->mode = IMMEDIATE;
-    src->data = buf[i++];
-    if (inst.s == 1 && inst.w == 1)
-    {
-        src->data = (u8) src->data;
-    }
+    i += decode_data (&buf[i], inst, &src->data);
 
 //    printf ("DEBUG:  data="BIN_FMT"  "BIN_FMT"\n", BIN_VAL ((src->data >> 8)), BIN_VAL ((src->data & 0xFF)));
 //    printf ("DEBUG:  data=%u %d %d %d\n", src->data, src->data, (s8) src->data, (s16) src->data);
 
-    instruction_print (&inst);
-
     return i;
 }
 
 static u8
-decode_cmp_iwa (u8 *buf)
+decode_cmp_iwa (u8 *buf, struct instruction *inst)
 {
-    struct instruction inst = { .name = "cmp" };
+    inst->name = "cmp";
+    inst->op = OP_CMP;
+    inst->encoding = ENC_IMM_ACC;
     u8 i = 0;
 
 //    printf ("%s\n", __func__);
@@ -670,27 +689,25 @@ decode_cmp_iwa (u8 *buf)
 
     ASSERT ((b0 >> 1) == 0b0011110);
 
-    inst.w = (b0 & 0b1);
-    inst.d = 1;       // implied
-    inst.reg = 0b000; // implied
+    inst->w = (b0 & 0b1);
+    inst->d = 1;       // implied
+    inst->reg = 0b000; // implied
     
-    decode_operands (&inst);
+    decode_operands (inst);
 
-    struct operand *src = &inst.operands[i];
+    struct operand *src = &inst->operands[1];
     src->mode = IMMEDIATE;
     src->data = buf[i++];
-    if (inst.w == 1)
+    if (inst->w == 1)
     {
         src->data |= buf[i++] << 8;
     }
 
-    instruction_print (&inst);
-
     return i;
 }
 
 static u8
-decode_shared_100000xx (u8 *buf)
+decode_shared_100000xx (u8 *buf, struct instruction *inst)
 {
     u8 i = 0;
     u8 b0 = buf[i++];
@@ -702,24 +719,29 @@ decode_shared_100000xx (u8 *buf)
 
     if (reg == 0b000)
     {
-        i = decode_add_i2rm (buf);
+        i = decode_add_i2rm (buf, inst);
     }
     else if (reg == 0b101)
     {
-        i = decode_sub_ifrm (buf);
+        i = decode_sub_ifrm (buf, inst);
     }
     else if (reg == 0b111)
     {
-        i = decode_cmp_iwrm (buf);
+        i = decode_cmp_iwrm (buf, inst);
+    }
+    else
+    {
+        // or/adc/sbb/and/xor aren't supported yet
+        i = 0;
     }
 
     return i;
 }
 
 
-typedef u8 (decode_f) (u8 *buf);
+typedef u8 (decode_f) (u8 *buf, struct instruction *inst);
 
-static decode_f *decode_table[] = {
+static decode_f *decode_table[256] = {
    /* mov (register/memory to/from register)
     * 100010xx */
    [0b10001000] = decode_mov_rm2r,
@@ -801,6 +823,7 @@ static decode_f *decode_table[] = {
    [0b00111101] = decode_cmp_iwa,
 };
 
+#if 0
 static char *
 binary_print (char *str, size_t len, u8 byte)
 {
@@ -852,63 +875,159 @@ dump_instruction (struct instruction *inst)
             BIN_VAL ((inst->disp << 8)), BIN_VAL ((inst->disp & 0xFF)),
             BIN_VAL ((inst->data << 8)), BIN_VAL ((inst->data & 0xFF)));
 }
+#endif
 
-static void
+static u8
+decode_instruction (u8 *buf, struct instruction *inst)
+{
+    u8 bytes_consumed = 0;
+
+    *inst = (struct instruction) {0};
+    if (decode_table[*buf])
+    {
+        bytes_consumed = decode_table[*buf] (buf, inst);
+    }
+
+    return bytes_consumed;
+}
+
+/* returns the number of bytes that were decoded before
+ * reaching the end of the input or an unknown opcode */
+static int
 decode (u8 *data, int len)
 {
     int bytes_consumed = 0;
+    int i = 0;
 
-    fprintf (fp, "; disassembly\n\n");
-    fprintf (fp, "bits 16\n\n");
+    format_header ();
+    format_offset_digits = offset_digits ((u32) len);
 
-    for (int i = 0; i < len; i += bytes_consumed)
+    for (i = 0; i < len; i += bytes_consumed)
     {
         u8 *ptr = &data[i];
-        if (decode_table[*ptr])
+        struct instruction inst;
+
+        bytes_consumed = decode_instruction (ptr, &inst);
+        if (bytes_consumed == 0)
         {
-            bytes_consumed = decode_table[*ptr] (ptr);
-            if (bytes_consumed == 0)
-            {
-                return;
-            }
+            format_unknown ((u32) i, *ptr);
+            break;
         }
-        else
+
+        format_instruction (&inst, (u32) i, ptr, bytes_consumed);
+    }
+    output_flush ();
+
+    return i;
+}
+
+/* decodes into an array of records on the arena, stopping at the first
+ * byte that can't be decoded. *decoded_len is how far it got, *lens
+ * (if asked for) the length of each instruction */
+static struct instruction *
+decode_all (struct arena *arena, u8 *data, int len, u32 *count, int *decoded_len, u8 **lens)
+{
+    // every instruction we decode is at least two bytes, the unused tail is trimmed below
+    u32 capacity = (u32) len / 2 + 1;
+    u8 *inst_lens = lens ? arena_push_array_nozero (arena, u8, capacity) : NULL;
+    struct instruction *insts = arena_push_array_nozero (arena, struct instruction, capacity);
+    int i = 0;
+    u32 n = 0;
+
+    while (i < len)
+    {
+        u8 bytes_consumed = decode_instruction (&data[i], &insts[n]);
+        if (bytes_consumed == 0)
         {
-            printf ("decode function for ["BIN_FMT"] not found\n", BIN_VAL (*ptr));
-            return;
+            break;
         }
+
+        if (inst_lens)
+        {
+            inst_lens[n] = bytes_consumed;
+        }
+        i += bytes_consumed;
+        n++;
+    }
+
+    arena_trim (arena, &insts[n]);
+
+    *count = n;
+    if (decoded_len)
+    {
+        *decoded_len = i;
     }
+    if (lens)
+    {
+        *lens = inst_lens;
+    }
+
+    return insts;
 }
 
+/* loads a whole file on to the arena, zero padded to a multiple of
+ * align bytes with at least 16 bytes of padding, so a truncated last
+ * instruction doesn't read past the end. Files over max_len bytes (0
+ * for no limit) are refused. On failure *error says why and NULL is
+ * returned, nothing is left on the arena */
 static u8 *
-read_file (char *file, int *read_len)
+read_file (struct arena *arena, char *file, u32 max_len, u32 align, u32 *read_len, char **error)
 {
-    int len = 0;
+    struct arena_mark mark = arena_mark (arena);
     u8 *data = NULL;
-    bool ok = false;
+    u32 len = 0;
 
-    FILE *fp = fopen (file, "rb");
-    if (fp)
-    {
-        fseek (fp, 0, SEEK_END);
-        len = ftell (fp);
-        fseek (fp, 0, SEEK_SET);
+    *read_len = 0;
+    *error = NULL;
+    max_len = max_len ? max_len : 0xFFFF0000u;
 
-        // TODO: allocate 1MB on start-up
-        data = (u8 *) malloc (len);
-        memset (data, 0, len);
-        fread (data, len, 1, fp);
+    FILE *f = fopen (file, "rb");
+    if (!f)
+    {
+        *error = strerror (errno);
+        return NULL;
+    }
 
-        *read_len = len;
+    // a directory opens fine on some systems, reading it is what fails
+    long size = (getc (f) != EOF || !ferror (f)) && fseek (f, 0, SEEK_END) == 0 ? ftell (f) : -1;
+    if (size < 0 || fseek (f, 0, SEEK_SET) != 0)
+    {
+        *error = strerror (errno);
+    }
+    else if ((u64) size > max_len)
+    {
+        *error = "over the size limit";
+    }
+    else
+    {
+        len = (u32) size;
 
-        fclose (fp);
+        u64 padded = ((u64) len + 16 + align - 1) / align * align;
+        if (!arena_fits (arena, padded))
+        {
+            *error = "too large to fit in memory";
+        }
+        else
+        {
+            data = arena_push_nozero (arena, padded);
+            memset (data + len, 0, padded - len);
+            if (fread (data, 1, len, f) != len)
+            {
+                *error = ferror (f) ? strerror (errno) : "file changed while reading";
+            }
+        }
     }
 
-    ok = (data && len > 0);
-    ASSERT (ok);
+    fclose (f);
+
+    if (*error)
+    {
+        arena_pop_to (mark);
+        return NULL;
+    }
 
 #if 0
-    debug ("Read [%s %d bytes] %s\n", file, len, (ok ? "OK" : "Error"));
+    debug ("Read [%s %d bytes] %s\n", file, len, "OK");
 
     int n_bytes = 0;
     for (int i = 0; i < len; i++)
@@ -926,60 +1045,644 @@ read_file (char *file, int *read_len)
     debug ("\n");
 #endif
 
+    *read_len = len;
+
     return data;
 }
 
-static char *
-parse_args (int argc, char **argv)
+#include "batch.c"
+#include "bench.c"
+#include "encode.c"
+#include "pool.c"
+#include "sweep.c"
+#include "exec.c"
+#include "lanes.c"
+#include "trace.c"
+#include "profile.c"
+#include "serve.c"
+#include "cache.c"
+#include "diff.c"
+
+enum run_mode
 {
-    char *ret = NULL;
+    MODE_DISASSEMBLE,
+    MODE_BENCH,
+    MODE_VERIFY,
+    MODE_SWEEP,
+    MODE_LANES_CHECK,
+    MODE_TRACE_CHECK,
+    MODE_MEMORY_WRITES,
+    MODE_RUN,
+    MODE_SEARCH,
+    MODE_REPLAY,
+    MODE_SERVE,
+    MODE_CONNECT,
+    MODE_DIFF,
+};
 
-    for (int i = 1; i < argc; i++)
+struct options
+{
+    enum run_mode mode;
+    char **inputs;   // everything after the options
+    int input_count;
+    u32 threads;
+    char *program;   // --run, --search
+    u32 dump_addr;
+    u32 dump_len;
+    char *trace;     // --trace, or the file to --replay
+    u32 snapshot_interval;
+    u64 step;
+    bool profile;
+    char *heatmap;
+    char *socket;    // --serve, --connect
+    bool mem_writes;
+    bool send_path;
+    bool shutdown;
+    char *cache_dir;
+    u64 cache_size;
+    struct bench_config bench;
+    struct search search;
+    bool vary_set;
+};
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: [-f OUTPUT-FILE] INPUT-FILE...\n");
+    fprintf (stderr, "       --verify [INPUT-FILE...]  (verifies a generated corpus if no file is given)\n");
+    fprintf (stderr, "       --mem-writes INPUT-FILE...  (lists the instructions that write to memory)\n");
+    fprintf (stderr, "       --diff INPUT-FILE INPUT-FILE  (instructions removed, added and changed between the two)\n");
+    fprintf (stderr, "       --run PROGRAM [-j THREADS] [--dump ADDRESS,LENGTH] [MEMORY-IMAGE...]\n");
+    fprintf (stderr, "       --run PROGRAM --trace TRACE-FILE [--snapshot STEPS] [--dump ADDRESS,LENGTH] [MEMORY-IMAGE]\n");
+    fprintf (stderr, "       --run PROGRAM --profile [--heatmap PGM-FILE] [MEMORY-IMAGE...]\n");
+    fprintf (stderr, "       --replay TRACE-FILE --step N [--dump ADDRESS,LENGTH]\n");
+    fprintf (stderr, "       --search PROGRAM --vary REG[=FROM..TO] --want REG=VALUE... [--set REG=VALUE...] [--scalar]\n");
+    fprintf (stderr, "       --sweep [-j THREADS]\n");
+    fprintf (stderr, "       --lanes-check  (checks the lane-parallel executor against the scalar one)\n");
+    fprintf (stderr, "       --trace-check [--trace TRACE-FILE]  (records a generated run and checks --replay against it)\n");
+    fprintf (stderr, "       --serve SOCKET-PATH [-j THREADS]\n");
+    fprintf (stderr, "       --connect SOCKET-PATH [--syntax ...] [--listing] [--mem-writes] [--send-path] INPUT-FILE...\n");
+    fprintf (stderr, "       --connect SOCKET-PATH --shutdown\n");
+    fprintf (stderr, "       --syntax nasm|masm|att|json  (output syntax for disassembly and --mem-writes)\n");
+    fprintf (stderr, "       --listing  (offset and encoded bytes before every instruction)\n");
+    fprintf (stderr, "       --cache DIR [--cache-size MB]  (reuse the output of inputs seen before)\n");
+    fprintf (stderr, "       --bench [-n BYTES] [-r REPEATS] [-s SEED] [--mix mov=4,add=2,sub=2,cmp=2]\n");
+    fprintf (stderr, "               [--mod 1,1,1,2] [--wide PERCENT] [--imm PERCENT]\n");
+}
+
+static bool
+parse_args (int argc, char **argv, struct options *opts)
+{
+    bool ok = true;
+
+    opts->mode = MODE_DISASSEMBLE;
+    opts->inputs = NULL;
+    opts->input_count = 0;
+    opts->threads = 0;
+    opts->program = NULL;
+    opts->dump_addr = 0;
+    opts->dump_len = 0;
+    opts->trace = NULL;
+    opts->snapshot_interval = 0;
+    opts->step = 0;
+    opts->profile = false;
+    opts->heatmap = NULL;
+    opts->socket = NULL;
+    opts->mem_writes = false;
+    opts->send_path = false;
+    opts->shutdown = false;
+    opts->cache_dir = NULL;
+    opts->cache_size = 0;
+    opts->bench = bench_defaults;
+    opts->search = (struct search) { .to = 0xFFFF };
+    opts->vary_set = false;
+
+    for (int i = 1; i < argc && ok; i++)
     {
-        if (strcmp (argv[i], "-f") == 0)
+        char *arg = argv[i];
+        char *param = (i + 1 < argc) ? argv[i + 1] : NULL;
+        bool takes_param = (strcmp (arg, "-f") == 0 ||
+                            strcmp (arg, "-j") == 0 ||
+                            strcmp (arg, "--run") == 0 ||
+                            strcmp (arg, "--dump") == 0 ||
+                            strcmp (arg, "--syntax") == 0 ||
+                            strcmp (arg, "--trace") == 0 ||
+                            strcmp (arg, "--snapshot") == 0 ||
+                            strcmp (arg, "--replay") == 0 ||
+                            strcmp (arg, "--heatmap") == 0 ||
+                            strcmp (arg, "--cache") == 0 ||
+                            strcmp (arg, "--cache-size") == 0 ||
+                            strcmp (arg, "--serve") == 0 ||
+                            strcmp (arg, "--connect") == 0 ||
+                            strcmp (arg, "--step") == 0 ||
+                            strcmp (arg, "--search") == 0 ||
+                            strcmp (arg, "--vary") == 0 ||
+                            strcmp (arg, "--want") == 0 ||
+                            strcmp (arg, "--set") == 0 ||
+                            strcmp (arg, "-n") == 0 ||
+                            strcmp (arg, "-r") == 0 ||
+                            strcmp (arg, "-s") == 0 ||
+                            strcmp (arg, "--mix") == 0 ||
+                            strcmp (arg, "--mod") == 0 ||
+                            strcmp (arg, "--wide") == 0 ||
+                            strcmp (arg, "--imm") == 0);
+
+        if (takes_param && !param)
         {
-            if (i + 1 < argc)
+            fprintf (stderr, "Error: Missing parameter for argument '%s'\n", arg);
+            ok = false;
+            break;
+        }
+
+        if (strcmp (arg, "-f") == 0)
+        {
+            fp = fopen (param, "w");
+            if (!fp)
             {
-                fp = fopen (argv[i + 1], "w");
-                i++;
+                fprintf (stderr, "Error: Could not open '%s' for writing\n", param);
+                fp = stdout;
+                ok = false;
+            }
+        }
+        else if (strcmp (arg, "--bench") == 0)
+        {
+            opts->mode = MODE_BENCH;
+        }
+        else if (strcmp (arg, "--verify") == 0)
+        {
+            opts->mode = MODE_VERIFY;
+        }
+        else if (strcmp (arg, "--mem-writes") == 0)
+        {
+            opts->mode = MODE_MEMORY_WRITES;
+            opts->mem_writes = true;
+        }
+        else if (strcmp (arg, "--diff") == 0)
+        {
+            opts->mode = MODE_DIFF;
+        }
+        else if (strcmp (arg, "--serve") == 0)
+        {
+            opts->mode = MODE_SERVE;
+            opts->socket = param;
+        }
+        else if (strcmp (arg, "--connect") == 0)
+        {
+            opts->mode = MODE_CONNECT;
+            opts->socket = param;
+        }
+        else if (strcmp (arg, "--cache") == 0)
+        {
+            opts->cache_dir = param;
+        }
+        else if (strcmp (arg, "--cache-size") == 0)
+        {
+            opts->cache_size = strtoull (param, NULL, 0) << 20;
+        }
+        else if (strcmp (arg, "--send-path") == 0)
+        {
+            opts->send_path = true;
+        }
+        else if (strcmp (arg, "--shutdown") == 0)
+        {
+            opts->shutdown = true;
+        }
+        else if (strcmp (arg, "--run") == 0)
+        {
+            opts->mode = MODE_RUN;
+            opts->program = param;
+        }
+        else if (strcmp (arg, "--dump") == 0)
+        {
+            char *end = NULL;
+
+            opts->dump_addr = (u32) strtoul (param, &end, 0);
+            if (*end == ',')
+            {
+                unsigned long len = strtoul (end + 1, NULL, 0);
+
+                // more than all of memory would only repeat it
+                if (len > MEMORY_SIZE)
+                {
+                    fprintf (stderr, "Error: --dump LENGTH is over the %u bytes of memory\n", MEMORY_SIZE);
+                    ok = false;
+                }
+                opts->dump_len = (u32) len;
             }
             else
             {
-                fprintf (stderr, "Error: Missing filename parameter for argument '-f'\n");
-                break;
+                fprintf (stderr, "Error: --dump expects ADDRESS,LENGTH\n");
+                ok = false;
+            }
+        }
+        else if (strcmp (arg, "--syntax") == 0)
+        {
+            format = format_find (param);
+            if (!format)
+            {
+                fprintf (stderr, "Error: Unknown syntax '%s'\n", param);
+                format = &formats[SYNTAX_NASM];
+                ok = false;
+            }
+        }
+        else if (strcmp (arg, "--listing") == 0)
+        {
+            format_listing = true;
+        }
+        else if (strcmp (arg, "--trace") == 0)
+        {
+            opts->trace = param;
+        }
+        else if (strcmp (arg, "--snapshot") == 0)
+        {
+            opts->snapshot_interval = (u32) strtoul (param, NULL, 0);
+        }
+        else if (strcmp (arg, "--profile") == 0)
+        {
+            opts->profile = true;
+        }
+        else if (strcmp (arg, "--heatmap") == 0)
+        {
+            opts->profile = true;
+            opts->heatmap = param;
+        }
+        else if (strcmp (arg, "--replay") == 0)
+        {
+            opts->mode = MODE_REPLAY;
+            opts->trace = param;
+        }
+        else if (strcmp (arg, "--step") == 0)
+        {
+            opts->step = strtoull (param, NULL, 0);
+        }
+        else if (strcmp (arg, "--search") == 0)
+        {
+            opts->mode = MODE_SEARCH;
+            opts->program = param;
+        }
+        else if (strcmp (arg, "--vary") == 0)
+        {
+            char *eq = strchr (param, '=');
+            size_t len = eq ? (size_t) (eq - param) : strlen (param);
+
+            ok = search_parse_reg (param, len, &opts->search.vary);
+            if (ok && eq)
+            {
+                char *end = NULL;
+
+                opts->search.from = (u32) strtoul (eq + 1, &end, 0);
+                ok = strncmp (end, "..", 2) == 0;
+                if (ok)
+                {
+                    opts->search.to = (u32) strtoul (end + 2, NULL, 0);
+                }
+                ok = ok && opts->search.from <= opts->search.to && opts->search.to <= 0xFFFF;
             }
+            if (!ok)
+            {
+                fprintf (stderr, "Error: --vary expects REG or REG=FROM..TO\n");
+            }
+            opts->vary_set = ok;
+        }
+        else if (strcmp (arg, "--want") == 0)
+        {
+            u8 n = opts->search.want_count;
+
+            ok = n < SEARCH_MAX_REGS && search_parse_assign (param, &opts->search.want_reg[n], &opts->search.want_value[n]);
+            if (!ok)
+            {
+                fprintf (stderr, "Error: --want expects REG=VALUE (at most %d)\n", SEARCH_MAX_REGS);
+            }
+            opts->search.want_count++;
+        }
+        else if (strcmp (arg, "--set") == 0)
+        {
+            u8 r;
+            u16 value;
+
+            ok = search_parse_assign (param, &r, &value);
+            if (ok)
+            {
+                opts->search.set[r] = value;
+            }
+            else
+            {
+                fprintf (stderr, "Error: --set expects REG=VALUE\n");
+            }
+        }
+        else if (strcmp (arg, "--scalar") == 0)
+        {
+            opts->search.scalar = true;
+        }
+        else if (strcmp (arg, "--sweep") == 0)
+        {
+            opts->mode = MODE_SWEEP;
+        }
+        else if (strcmp (arg, "--lanes-check") == 0)
+        {
+            opts->mode = MODE_LANES_CHECK;
+        }
+        else if (strcmp (arg, "--trace-check") == 0)
+        {
+            opts->mode = MODE_TRACE_CHECK;
+        }
+        else if (strcmp (arg, "-j") == 0)
+        {
+            opts->threads = (u32) strtoul (param, NULL, 0);
+        }
+        else if (strcmp (arg, "-n") == 0)
+        {
+            opts->bench.bytes = (u32) strtoul (param, NULL, 0);
+        }
+        else if (strcmp (arg, "-r") == 0)
+        {
+            opts->bench.repeats = (u32) strtoul (param, NULL, 0);
+        }
+        else if (strcmp (arg, "-s") == 0)
+        {
+            opts->bench.seed = strtoull (param, NULL, 0);
+        }
+        else if (strcmp (arg, "--mix") == 0)
+        {
+            ok = bench_parse_mix (&opts->bench, param);
+        }
+        else if (strcmp (arg, "--mod") == 0)
+        {
+            ok = bench_parse_mod (&opts->bench, param);
+        }
+        else if (strcmp (arg, "--wide") == 0)
+        {
+            opts->bench.wide_pct = (u32) strtoul (param, NULL, 0);
+        }
+        else if (strcmp (arg, "--imm") == 0)
+        {
+            opts->bench.imm_pct = (u32) strtoul (param, NULL, 0);
         }
         else
         {
-            ret = argv[i];
+            opts->inputs = &argv[i];
+            opts->input_count = argc - i;
             break;
         }
+
+        if (takes_param)
+        {
+            i++;
+        }
     }
 
-    if (!ret)
+    if (ok && (opts->mode == MODE_BENCH || opts->mode == MODE_VERIFY))
     {
-        fprintf (stderr, "Usage: [-f OUTPUT-FILE] INPUT-FILE\n");
+        u32 mix = 0;
+        u32 mod = 0;
+
+        for (int f = 0; f < FAMILY_COUNT; f++)
+        {
+            mix += opts->bench.mix[f];
+        }
+        for (int m = 0; m < 4; m++)
+        {
+            mod += opts->bench.mod[m];
+        }
+
+        if (mix == 0 || mod == 0)
+        {
+            fprintf (stderr, "Error: --mix and --mod need at least one non-zero weight\n");
+            ok = false;
+        }
+    }
+    if (opts->socket && opts->mode != MODE_SERVE)
+    {
+        opts->mode = MODE_CONNECT; // --mem-writes after --connect is a request option
+    }
+    if (ok && opts->mode == MODE_CONNECT && !opts->shutdown && opts->input_count == 0)
+    {
+        ok = false;
+    }
+    if (ok && format_listing && format->has_offset)
+    {
+        fprintf (stderr, "Error: --listing is for the text syntaxes, %s records already have offsets\n", format->name);
+        ok = false;
+    }
+    if (ok && opts->mode == MODE_DIFF && (opts->input_count != 2 || format->has_offset))
+    {
+        fprintf (stderr, "Error: --diff compares two files in one of the text syntaxes\n");
+        ok = false;
+    }
+    if (ok && opts->mode == MODE_RUN && opts->trace && opts->profile)
+    {
+        fprintf (stderr, "Error: --trace and --profile can't be used together\n");
+        ok = false;
+    }
+    if (ok && opts->mode == MODE_RUN && opts->trace && opts->input_count > 1)
+    {
+        fprintf (stderr, "Error: --trace records a single run, give at most one memory image\n");
+        ok = false;
+    }
+    if (ok && opts->mode == MODE_SEARCH && (!opts->vary_set || opts->search.want_count == 0))
+    {
+        fprintf (stderr, "Error: --search needs --vary and at least one --want\n");
+        ok = false;
+    }
+    if (ok && (opts->mode == MODE_DISASSEMBLE || opts->mode == MODE_MEMORY_WRITES) && opts->input_count == 0)
+    {
+        ok = false;
     }
 
-    return ret;
+    if (!ok)
+    {
+        usage ();
+    }
+
+    return ok;
 }
 
 int
 main (int argc, char **argv)
 {
+    struct options opts;
+    struct arena arena = {0};
+    int ret = 0;
+
     fp = stdout;
-    char *file = parse_args (argc, argv);
 
-    if (file)
+    if (!parse_args (argc, argv, &opts))
     {
-        int len = 0;
-        u8 *data = NULL;
+        ret = 1;
+    }
+    else if (!arena_init (&arena, ARENA_RESERVE_SIZE))
+    {
+        fprintf (stderr, "Error: Could not reserve memory\n");
+        ret = 1;
+    }
+    else
+    {
+        setvbuf (fp, arena_push_nozero (&arena, OUTPUT_BUFFER_SIZE), _IOFBF, OUTPUT_BUFFER_SIZE);
+        output_set_buffer (arena_push_nozero (&arena, OUTPUT_BUFFER_SIZE), OUTPUT_BUFFER_SIZE);
+
+        if (opts.mode == MODE_BENCH)
+        {
+            ret = bench_run (&arena, &opts.bench);
+        }
+        else if (opts.mode == MODE_SWEEP)
+        {
+            ret = sweep_run (&arena, opts.threads);
+        }
+        else if (opts.mode == MODE_LANES_CHECK)
+        {
+            ret = lanes_check_run (&arena);
+        }
+        else if (opts.mode == MODE_TRACE_CHECK)
+        {
+            // a scratch file, removed afterwards
+            ret = trace_check_run (&arena, opts.trace ? opts.trace : "trace-check.t86");
+        }
+        else if (opts.mode == MODE_RUN)
+        {
+            u32 len = 0;
+            char *error = NULL;
+            u8 *code = read_file (&arena, opts.program, 0, 1, &len, &error);
+            struct program program;
+
+            if (!code)
+            {
+                fprintf (stderr, "Error: Could not read '%s': %s\n", opts.program, error);
+                ret = 1;
+            }
+            else if (!program_load (&arena, code, (int) len, &program))
+            {
+                ret = 1;
+            }
+            else if (opts.profile)
+            {
+                ret = profile_run (&arena, &program, opts.inputs, (u32) opts.input_count, opts.heatmap);
+            }
+            else if (opts.trace)
+            {
+                u32 image_len = 0;
+                char *error = NULL;
+                u8 *image = (opts.input_count == 1) ? image_load (&arena, opts.inputs[0], &image_len, &error) : NULL;
+
+                if (opts.input_count == 1 && !image)
+                {
+                    fprintf (stderr, "Error: Could not read '%s': %s\n", opts.inputs[0], error);
+                    ret = 1;
+                }
+                else
+                {
+                    ret = trace_run (&arena, &program, image, image_len, opts.trace,
+                                     opts.snapshot_interval, opts.dump_addr, opts.dump_len);
+                }
+            }
+            else if (opts.input_count == 0)
+            {
+                ret = exec_single_run (&arena, &program, opts.dump_addr, opts.dump_len);
+            }
+            else
+            {
+                ret = exec_batch_run (&arena, &program, opts.inputs, (u32) opts.input_count,
+                                      opts.threads, opts.dump_addr, opts.dump_len);
+            }
+        }
+        else if (opts.mode == MODE_SERVE)
+        {
+            ret = serve_run (&arena, opts.socket, opts.threads);
+        }
+        else if (opts.mode == MODE_CONNECT)
+        {
+            u8 flags = (format_listing ? SERVE_LISTING : 0) | (opts.mem_writes ? SERVE_MEM_WRITES : 0);
 
-        data = read_file (file, &len);
-        if (data && len > 0)
+            ret = serve_connect (&arena, opts.socket, opts.inputs, (u32) opts.input_count,
+                                 flags, opts.send_path, opts.shutdown);
+        }
+        else if (opts.mode == MODE_DIFF)
+        {
+            ret = diff_run (&arena, opts.inputs[0], opts.inputs[1]);
+        }
+        else if (opts.mode == MODE_REPLAY)
         {
-            decode (data, len);
-            free (data);
+            ret = trace_replay (&arena, opts.trace, opts.step, opts.dump_addr, opts.dump_len);
+        }
+        else if (opts.mode == MODE_SEARCH)
+        {
+            u32 len = 0;
+            char *error = NULL;
+            u8 *code = read_file (&arena, opts.program, 0, 1, &len, &error);
+            struct program program;
+
+            if (!code)
+            {
+                fprintf (stderr, "Error: Could not read '%s': %s\n", opts.program, error);
+                ret = 1;
+            }
+            else if (!program_load (&arena, code, (int) len, &program))
+            {
+                ret = 1;
+            }
+            else
+            {
+                ret = search_run (&arena, &program, &opts.search);
+            }
+        }
+        else if (opts.mode == MODE_VERIFY && opts.input_count == 0)
+        {
+            u8 *corpus = arena_push (&arena, opts.bench.bytes + 16);
+            u32 len = gen_corpus (corpus, opts.bench.bytes, &opts.bench);
+
+            ret = verify (corpus, (int) len);
+        }
+        else
+        {
+            /* everything for one file is allocated after this mark,
+             * so batches of files reuse the same memory */
+            struct arena_mark mark = arena_mark (&arena);
+            struct cache cache;
+
+            if (opts.cache_dir && !cache_init (&cache, opts.cache_dir, opts.cache_size))
+            {
+                opts.cache_dir = NULL; // carry on without it
+                ret = 1;
+            }
+
+            for (int f = 0; f < opts.input_count; f++)
+            {
+                u32 len = 0;
+                char *error = NULL;
+                u8 *data = read_file (&arena, opts.inputs[f], 0, 1, &len, &error);
+
+                if (!data)
+                {
+                    fprintf (stderr, "Error: Could not read '%s': %s\n", opts.inputs[f], error);
+                    ret = 1;
+                }
+                else if (len > 0)
+                {
+                    if (opts.mode == MODE_VERIFY)
+                    {
+                        ret |= verify (data, len);
+                    }
+                    else if (opts.cache_dir)
+                    {
+                        cache_run (&arena, &cache, data, len, opts.mode == MODE_MEMORY_WRITES);
+                    }
+                    else if (opts.mode == MODE_MEMORY_WRITES)
+                    {
+                        struct inst_batch batch = batch_decode (&arena, data, len, NULL);
+                        batch_print_memory_writes (&arena, &batch);
+                    }
+                    else
+                    {
+                        decode (data, len);
+                    }
+                }
+
+                arena_pop_to (mark);
+            }
+
+            if (opts.cache_dir)
+            {
+                fprintf (stderr, "cache: %u hits, %u misses\n", cache.hits, cache.misses);
+            }
         }
     }
 
@@ -987,6 +1690,12 @@ main (int argc, char **argv)
     {
         fclose (fp);
     }
+    else
+    {
+        fflush (fp);
+    }
 
-    return 0;
+    arena_release (&arena);
+
+    return ret;
 }
@@ -0,0 +1,413 @@
+/**
+ * Platform layer
+ *
+ * Everything that differs between Windows (cl.exe, see build.bat) and
+ * POSIX (cc, see build.sh) lives here so the rest of the program can
+ * stay plain C.
+ */
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#pragma comment (lib, "psapi.lib")
+#define NULL_DEVICE "NUL"
+#define THREAD_LOCAL __declspec (thread)
+#else
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#define NULL_DEVICE "/dev/null"
+#define THREAD_LOCAL __thread
+#endif
+
+typedef void (thread_f) (void *param);
+
+struct thread
+{
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    thread_f *func;
+    void *param;
+};
+
+/* monotonic wall clock in nanoseconds */
+static u64
+time_now_ns (void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0)
+    {
+        QueryPerformanceFrequency (&freq);
+    }
+    QueryPerformanceCounter (&now);
+
+    return (u64) ((double) now.QuadPart * 1e9 / (double) freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (u64) ts.tv_sec * 1000000000ull + (u64) ts.tv_nsec;
+#endif
+}
+
+/* total (minor + major) page faults taken by this process so far */
+static u64
+page_faults (void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc = { .cb = sizeof (pmc) };
+    GetProcessMemoryInfo (GetCurrentProcess (), &pmc, sizeof (pmc));
+
+    return pmc.PageFaultCount;
+#else
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+
+    return (u64) usage.ru_minflt + (u64) usage.ru_majflt;
+#endif
+}
+
+static u32
+cpu_count (void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo (&info);
+
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+    return (n > 0) ? (u32) n : 1;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+thread_entry (LPVOID param)
+{
+    struct thread *thread = param;
+    thread->func (thread->param);
+
+    return 0;
+}
+#else
+static void *
+thread_entry (void *param)
+{
+    struct thread *thread = param;
+    thread->func (thread->param);
+
+    return NULL;
+}
+#endif
+
+/* thread must stay alive until thread_join() */
+static bool
+thread_start (struct thread *thread, thread_f *func, void *param)
+{
+    thread->func = func;
+    thread->param = param;
+
+#ifdef _WIN32
+    thread->handle = CreateThread (NULL, 0, thread_entry, thread, 0, NULL);
+
+    return thread->handle != NULL;
+#else
+    return pthread_create (&thread->handle, NULL, thread_entry, thread) == 0;
+#endif
+}
+
+static void
+thread_join (struct thread *thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject (thread->handle, INFINITE);
+    CloseHandle (thread->handle);
+#else
+    pthread_join (thread->handle, NULL);
+#endif
+}
+
+/* reserves address space, pages are only backed by memory once
+ * os_commit() has been called on them */
+static void *
+os_reserve (u64 size)
+{
+#ifdef _WIN32
+    return VirtualAlloc (NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    void *ptr = mmap (NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+#endif
+}
+
+/* committed pages read as zero until they are written */
+static bool
+os_commit (void *ptr, u64 size)
+{
+#ifdef _WIN32
+    return VirtualAlloc (ptr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+    return mprotect (ptr, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+static void
+os_release (void *ptr, u64 size)
+{
+#ifdef _WIN32
+    (void) size;
+    VirtualFree (ptr, 0, MEM_RELEASE);
+#else
+    munmap (ptr, size);
+#endif
+}
+
+static u32
+atomic_swap_u32 (volatile u32 *value, u32 new_value)
+{
+#ifdef _WIN32
+    return (u32) InterlockedExchange ((volatile LONG *) value, (LONG) new_value);
+#else
+    return __atomic_exchange_n (value, new_value, __ATOMIC_ACQ_REL);
+#endif
+}
+
+static u32
+atomic_load_u32 (volatile u32 *value)
+{
+#ifdef _WIN32
+    return (u32) InterlockedCompareExchange ((volatile LONG *) value, 0, 0);
+#else
+    return __atomic_load_n (value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static void
+atomic_store_u32 (volatile u32 *value, u32 new_value)
+{
+#ifdef _WIN32
+    InterlockedExchange ((volatile LONG *) value, (LONG) new_value);
+#else
+    __atomic_store_n (value, new_value, __ATOMIC_RELEASE);
+#endif
+}
+
+/* gives the rest of the time slice to another thread */
+static void
+thread_yield (void)
+{
+#ifdef _WIN32
+    SwitchToThread ();
+#else
+    sched_yield ();
+#endif
+}
+
+static void
+thread_sleep_ms (u32 ms)
+{
+#ifdef _WIN32
+    Sleep (ms);
+#else
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (long) (ms % 1000) * 1000000 };
+    nanosleep (&ts, NULL);
+#endif
+}
+
+/* hint for spin-wait loops */
+static void
+cpu_pause (void)
+{
+#ifdef _WIN32
+    YieldProcessor ();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause ();
+#endif
+}
+
+/* maps a whole file read-only. NULL if it can't be opened or is empty */
+static void *
+os_map_file (char *path, u64 *size)
+{
+    void *ptr = NULL;
+
+    *size = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA (path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER file_size;
+
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        if (GetFileSizeEx (file, &file_size) && file_size.QuadPart > 0)
+        {
+            HANDLE mapping = CreateFileMappingA (file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping)
+            {
+                ptr = MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle (mapping);
+                *size = ptr ? (u64) file_size.QuadPart : 0;
+            }
+        }
+        CloseHandle (file);
+    }
+#else
+    int fd = open (path, O_RDONLY);
+    struct stat st;
+
+    if (fd >= 0)
+    {
+        if (fstat (fd, &st) == 0 && st.st_size > 0)
+        {
+            ptr = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr == MAP_FAILED)
+            {
+                ptr = NULL;
+            }
+            *size = ptr ? (u64) st.st_size : 0;
+        }
+        close (fd);
+    }
+#endif
+
+    return ptr;
+}
+
+static void
+os_unmap_file (void *ptr, u64 size)
+{
+#ifdef _WIN32
+    (void) size;
+    UnmapViewOfFile (ptr);
+#else
+    munmap (ptr, size);
+#endif
+}
+
+/* sets the modification time to now */
+static void
+os_touch_file (char *path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA (path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    FILETIME now;
+
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        GetSystemTimeAsFileTime (&now);
+        SetFileTime (file, NULL, NULL, &now);
+        CloseHandle (file);
+    }
+#else
+    utime (path, NULL);
+#endif
+}
+
+/* true if the directory exists afterwards */
+static bool
+os_make_dir (char *path)
+{
+#ifdef _WIN32
+    return CreateDirectoryA (path, NULL) || GetLastError () == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir (path, 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+/* replaces to if it already exists */
+static bool
+os_rename (char *from, char *to)
+{
+#ifdef _WIN32
+    return MoveFileExA (from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename (from, to) == 0;
+#endif
+}
+
+/* name is relative to the directory, mtime in nanoseconds (only good for
+ * ordering, the epoch differs between platforms) */
+typedef void (dir_f) (void *context, char *name, u64 size, u64 mtime);
+
+/* calls func for every regular file in dir whose name ends in suffix */
+static void
+os_list_dir (char *dir, char *suffix, dir_f *func, void *context)
+{
+    size_t suffix_len = strlen (suffix);
+    char path[4096];
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA find;
+
+    snprintf (path, sizeof (path), "%s\\*%s", dir, suffix);
+    HANDLE handle = FindFirstFileA (path, &find);
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (!(find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                u64 size = ((u64) find.nFileSizeHigh << 32) | find.nFileSizeLow;
+                u64 ticks = ((u64) find.ftLastWriteTime.dwHighDateTime << 32) | find.ftLastWriteTime.dwLowDateTime;
+
+                func (context, find.cFileName, size, ticks * 100); // 100ns ticks
+            }
+        } while (FindNextFileA (handle, &find));
+        FindClose (handle);
+    }
+#else
+    DIR *d = opendir (dir);
+    struct dirent *entry;
+    struct stat st;
+
+    if (!d)
+    {
+        return;
+    }
+
+    while ((entry = readdir (d)))
+    {
+        size_t len = strlen (entry->d_name);
+
+        if (len < suffix_len || strcmp (entry->d_name + len - suffix_len, suffix) != 0)
+        {
+            continue;
+        }
+
+        snprintf (path, sizeof (path), "%s/%s", dir, entry->d_name);
+        if (stat (path, &st) == 0 && S_ISREG (st.st_mode))
+        {
+#ifdef __APPLE__
+            u64 mtime = (u64) st.st_mtimespec.tv_sec * 1000000000ull + (u64) st.st_mtimespec.tv_nsec;
+#else
+            u64 mtime = (u64) st.st_mtim.tv_sec * 1000000000ull + (u64) st.st_mtim.tv_nsec;
+#endif
+            func (context, entry->d_name, (u64) st.st_size, mtime);
+        }
+    }
+    closedir (d);
+#endif
+}
@@ -0,0 +1,199 @@
+/**
+ * Work-stealing thread pool
+ *
+ * pool_run() calls task(context, worker, index) once for every index in
+ * [0, count) across a fixed number of threads. Each worker starts with
+ * an even slice of the indices and takes them from the front; when it
+ * runs out it steals the back half of whichever slice has the most
+ * left. Uneven items (a slow instance, a big file) don't leave the
+ * other cores idle at the end.
+ *
+ * The worker number passed to the task is stable for the thread, so
+ * tasks can keep per-worker state (e.g. an arena) in an array.
+ */
+
+typedef void (pool_task_f) (void *context, u32 worker, u32 index);
+
+struct pool_range
+{
+    volatile u32 lock;
+    volatile u32 next; // written under the lock, but peeked at by thieves
+    volatile u32 end;
+    u8 pad[64 - 3 * sizeof (u32)]; // one cache line each
+};
+
+struct pool_worker
+{
+    struct thread thread;
+    bool started;
+    u32 index;
+    struct pool *pool;
+};
+
+struct pool
+{
+    u32 worker_count;
+    struct pool_range *ranges;
+    pool_task_f *task;
+    void *context;
+};
+
+static void
+pool_lock (struct pool_range *range)
+{
+    while (atomic_swap_u32 (&range->lock, 1) != 0)
+    {
+        while (atomic_load_u32 (&range->lock) != 0)
+        {
+            cpu_pause ();
+        }
+    }
+}
+
+static void
+pool_unlock (struct pool_range *range)
+{
+    atomic_store_u32 (&range->lock, 0);
+}
+
+/* takes the next index from the worker's own range */
+static bool
+pool_take (struct pool_range *range, u32 *index)
+{
+    bool ok = false;
+
+    pool_lock (range);
+    if (range->next < range->end)
+    {
+        *index = range->next;
+        atomic_store_u32 (&range->next, range->next + 1);
+        ok = true;
+    }
+    pool_unlock (range);
+
+    return ok;
+}
+
+/* moves the back half of the fullest other range into ours */
+static bool
+pool_steal (struct pool *pool, u32 thief)
+{
+    for (;;)
+    {
+        u32 victim = thief;
+        u32 most = 0;
+
+        // unlocked peek, rechecked under the lock below
+        for (u32 w = 0; w < pool->worker_count; w++)
+        {
+            struct pool_range *range = &pool->ranges[w];
+            u32 next = atomic_load_u32 (&range->next);
+            u32 end = atomic_load_u32 (&range->end);
+
+            if (w != thief && next < end && end - next > most)
+            {
+                most = end - next;
+                victim = w;
+            }
+        }
+
+        if (victim == thief)
+        {
+            return false;
+        }
+
+        struct pool_range *from = &pool->ranges[victim];
+        struct pool_range *to = &pool->ranges[thief];
+        bool stolen = false;
+
+        pool_lock (from);
+        if (from->next < from->end)
+        {
+            u32 mid = from->next + (from->end - from->next) / 2;
+
+            pool_lock (to);
+            atomic_store_u32 (&to->next, mid);
+            atomic_store_u32 (&to->end, from->end);
+            pool_unlock (to);
+
+            atomic_store_u32 (&from->end, mid);
+            stolen = true;
+        }
+        pool_unlock (from);
+
+        if (stolen)
+        {
+            return true;
+        }
+    }
+}
+
+static void
+pool_worker_run (void *param)
+{
+    struct pool_worker *worker = param;
+    struct pool *pool = worker->pool;
+    struct pool_range *range = &pool->ranges[worker->index];
+    u32 index;
+
+    for (;;)
+    {
+        while (pool_take (range, &index))
+        {
+            pool->task (pool->context, worker->index, index);
+        }
+
+        if (!pool_steal (pool, worker->index))
+        {
+            break;
+        }
+    }
+}
+
+/* the number of workers pool_run() will use */
+static u32
+pool_worker_count (u32 thread_count)
+{
+    return thread_count ? thread_count : cpu_count ();
+}
+
+/* thread_count 0 means one per core */
+static void
+pool_run (struct arena *arena, u32 thread_count, u32 count, pool_task_f *task, void *context)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct pool pool = {
+        .worker_count = pool_worker_count (thread_count),
+        .task = task,
+        .context = context,
+    };
+
+    pool.ranges = arena_push_array (arena, struct pool_range, pool.worker_count);
+    struct pool_worker *workers = arena_push_array (arena, struct pool_worker, pool.worker_count);
+
+    for (u32 w = 0; w < pool.worker_count; w++)
+    {
+        pool.ranges[w].next = (u32) ((u64) count * w / pool.worker_count);
+        pool.ranges[w].end = (u32) ((u64) count * (w + 1) / pool.worker_count);
+    }
+
+    for (u32 w = 0; w < pool.worker_count; w++)
+    {
+        workers[w].index = w;
+        workers[w].pool = &pool;
+        workers[w].started = thread_start (&workers[w].thread, pool_worker_run, &workers[w]);
+    }
+
+    for (u32 w = 0; w < pool.worker_count; w++)
+    {
+        if (workers[w].started)
+        {
+            thread_join (&workers[w].thread);
+        }
+    }
+
+    // anything left over belongs to threads that failed to start
+    pool_worker_run (&workers[0]);
+
+    arena_pop_to (mark);
+}
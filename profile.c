@@ -0,0 +1,297 @@
+/**
+ * Memory access profile
+ *
+ * --profile counts every memory read and write a run makes, per 16-byte
+ * granule of the 1MB address space and per segment register, and per
+ * instruction. The report lists the busiest granules and the
+ * instructions responsible for most of the traffic; --heatmap also
+ * writes the granule counts as a 256x256 greyscale PGM, one pixel per
+ * granule, row-major from address 0, 4KB per row.
+ *
+ * Counting happens outside exec_instruction(): memory operands are
+ * explicit in the decoded records, so the addresses are worked out
+ * before each step the same way the step itself will.
+ */
+
+#define GRANULE_SHIFT 4
+#define GRANULE_COUNT (MEMORY_SIZE >> GRANULE_SHIFT)
+#define PROFILE_TOP 16
+
+static char *profile_segment_names[] = { "es", "cs", "ss", "ds" };
+
+struct profile
+{
+    u32 *reads;  // GRANULE_COUNT each
+    u32 *writes;
+    u64 segment_reads[4];
+    u64 segment_writes[4];
+
+    u32 *site_accesses; // per instruction index
+    u64 steps;
+    u64 total_reads;
+    u64 total_writes;
+};
+
+static void
+profile_count (u32 *counts, u32 addr, u8 w)
+{
+    u32 first = (addr & (MEMORY_SIZE - 1)) >> GRANULE_SHIFT;
+    u32 last = ((addr + w) & (MEMORY_SIZE - 1)) >> GRANULE_SHIFT;
+
+    counts[first]++;
+    if (last != first)
+    {
+        counts[last]++; // word straddling two granules
+    }
+}
+
+static void
+profile_access (struct profile *profile, struct machine *m, struct instruction *inst,
+                struct operand *op, bool read, bool write, u32 n)
+{
+    if (op->mode != MEMORY && op->mode != DIRECT_ADDRESS)
+    {
+        return;
+    }
+
+    u32 addr = operand_address (m, op);
+    enum segment_register segment = operand_segment (op);
+
+    if (read)
+    {
+        profile_count (profile->reads, addr, inst->w);
+        profile->segment_reads[segment]++;
+        profile->total_reads++;
+        profile->site_accesses[n]++;
+    }
+    if (write)
+    {
+        profile_count (profile->writes, addr, inst->w);
+        profile->segment_writes[segment]++;
+        profile->total_writes++;
+        profile->site_accesses[n]++;
+    }
+}
+
+/* machine_run() counting the memory accesses of every step */
+static bool
+profile_machine_run (struct machine *m, struct program *program, struct profile *profile)
+{
+    while (m->ip < program->len)
+    {
+        u32 n = program->index_at[m->ip];
+        if (n == PROGRAM_NO_INSTRUCTION)
+        {
+            return false;
+        }
+
+        /* mov only writes its destination, add/sub read and write it,
+         * cmp only reads */
+        struct instruction *inst = &program->insts[n];
+        profile_access (profile, m, inst, &inst->operands[0], inst->op != OP_MOV, inst->op != OP_CMP, n);
+        profile_access (profile, m, inst, &inst->operands[1], true, false, n);
+
+        m->ip += program->lens[n];
+        exec_instruction (m, inst);
+        m->steps++;
+        profile->steps++;
+    }
+
+    return true;
+}
+
+/* keeps top[] (PROFILE_TOP indices, best first) sorted as values come in */
+static u32
+profile_top_insert (u32 *top, u64 *top_counts, u32 count, u32 index, u64 value)
+{
+    if (value == 0 || (count == PROFILE_TOP && value <= top_counts[count - 1]))
+    {
+        return count;
+    }
+
+    u32 i = (count < PROFILE_TOP) ? count++ : count - 1;
+    while (i > 0 && top_counts[i - 1] < value)
+    {
+        top[i] = top[i - 1];
+        top_counts[i] = top_counts[i - 1];
+        i--;
+    }
+    top[i] = index;
+    top_counts[i] = value;
+
+    return count;
+}
+
+static u32
+profile_bits (u32 value)
+{
+    u32 bits = 0;
+
+    while (value >> bits)
+    {
+        bits++;
+    }
+
+    return bits;
+}
+
+/* 0 for untouched granules, otherwise log scaled to 1..255 where 255
+ * is the busiest granule (max_bits is profile_bits() of its count) */
+static u8
+profile_shade (u32 count, u32 max_bits)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    if (max_bits <= 1)
+    {
+        return 255;
+    }
+
+    return (u8) (1 + (profile_bits (count) - 1) * 254 / (max_bits - 1));
+}
+
+static bool
+profile_write_heatmap (struct profile *profile, char *file)
+{
+    FILE *out = fopen (file, "wb");
+    u32 max = 0;
+    u8 row[256];
+    bool ok = true;
+
+    if (!out)
+    {
+        fprintf (stderr, "Error: Could not open '%s' for writing\n", file);
+        return false;
+    }
+
+    for (u32 g = 0; g < GRANULE_COUNT; g++)
+    {
+        u32 total = profile->reads[g] + profile->writes[g];
+        max = (total > max) ? total : max;
+    }
+    u32 max_bits = profile_bits (max);
+
+    fprintf (out, "P5\n256 256\n255\n");
+    for (u32 y = 0; y < 256; y++)
+    {
+        for (u32 x = 0; x < 256; x++)
+        {
+            u32 g = y * 256 + x;
+            row[x] = profile_shade (profile->reads[g] + profile->writes[g], max_bits);
+        }
+        ok &= fwrite (row, 1, sizeof (row), out) == sizeof (row);
+    }
+
+    ok &= fclose (out) == 0;
+    if (!ok)
+    {
+        fprintf (stderr, "Error: Could not write '%s'\n", file);
+    }
+
+    return ok;
+}
+
+static void
+profile_print (struct profile *profile, struct program *program)
+{
+    u32 top[PROFILE_TOP];
+    u64 top_counts[PROFILE_TOP];
+    u32 count = 0;
+
+    fprintf (fp, "Profile: %llu steps, %llu reads, %llu writes\n",
+             (unsigned long long) profile->steps, (unsigned long long) profile->total_reads,
+             (unsigned long long) profile->total_writes);
+
+    fprintf (fp, "Segments:\n");
+    for (int s = 0; s < 4; s++)
+    {
+        if (profile->segment_reads[s] || profile->segment_writes[s])
+        {
+            fprintf (fp, "      %s: %10llu reads %10llu writes\n", profile_segment_names[s],
+                     (unsigned long long) profile->segment_reads[s],
+                     (unsigned long long) profile->segment_writes[s]);
+        }
+    }
+
+    for (u32 g = 0; g < GRANULE_COUNT; g++)
+    {
+        count = profile_top_insert (top, top_counts, count, g, (u64) profile->reads[g] + profile->writes[g]);
+    }
+
+    fprintf (fp, "Hottest addresses:\n");
+    for (u32 i = 0; i < count; i++)
+    {
+        u32 addr = top[i] << GRANULE_SHIFT;
+        fprintf (fp, "  0x%05x-0x%05x: %10u reads %10u writes\n", addr, addr + (1 << GRANULE_SHIFT) - 1,
+                 profile->reads[top[i]], profile->writes[top[i]]);
+    }
+
+    count = 0;
+    for (u32 n = 0; n < program->count; n++)
+    {
+        count = profile_top_insert (top, top_counts, count, n, profile->site_accesses[n]);
+    }
+
+    fprintf (fp, "Hottest instructions:\n");
+    for (u32 i = 0; i < count; i++)
+    {
+        fprintf (fp, "  0x%04x: %10llu accesses  ", program->offsets[top[i]], (unsigned long long) top_counts[i]);
+        instruction_print (&program->insts[top[i]]);
+    }
+}
+
+/* runs the program on each image in turn (or once on empty memory),
+ * adding up the accesses, and prints the profile */
+static int
+profile_run (struct arena *arena, struct program *program, char **images, u32 count, char *heatmap)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct profile profile = {0};
+    int ret = 0;
+
+    profile.reads = arena_push_array (arena, u32, GRANULE_COUNT);
+    profile.writes = arena_push_array (arena, u32, GRANULE_COUNT);
+    profile.site_accesses = arena_push_array (arena, u32, program->count);
+
+    for (u32 i = 0; i < (count ? count : 1); i++)
+    {
+        struct arena_mark run = arena_mark (arena);
+        struct machine m;
+        u32 image_len = 0;
+        u8 *image = NULL;
+
+        if (count)
+        {
+            char *error = NULL;
+
+            image = image_load (arena, images[i], &image_len, &error);
+            if (!image)
+            {
+                fprintf (stderr, "Error: Could not read '%s': %s\n", images[i], error);
+                ret = 1;
+                continue;
+            }
+        }
+
+        machine_init (&m, arena, image, image_len);
+        if (!profile_machine_run (&m, program, &profile))
+        {
+            fprintf (stderr, "Error: ip 0x%04x is not the start of an instruction\n", m.ip);
+            ret = 1;
+        }
+
+        arena_pop_to (run);
+    }
+
+    profile_print (&profile, program);
+    if (heatmap && !profile_write_heatmap (&profile, heatmap))
+    {
+        ret = 1;
+    }
+
+    arena_pop_to (mark);
+
+    return ret;
+}
@@ -0,0 +1,505 @@
+/**
+ * Disassembly server
+ *
+ * --serve PATH listens on a Unix domain socket so tools that disassemble
+ * lots of small inputs don't pay for a process start each time. A fixed
+ * set of workers (-j, default one per core) each accept a connection
+ * and answer its requests until it closes; every worker keeps its own
+ * arena and output buffer for the life of the server.
+ *
+ * Workers wait in poll() on their socket and on a pipe that a shutdown
+ * request writes one byte to and nobody reads, so it wakes every worker
+ * at once, idle connections included.
+ *
+ * A connection carries any number of requests, each answered in order:
+ *
+ *   request   u32 length, then length bytes:
+ *             u8 type (enum serve_type), u8 syntax (enum syntax),
+ *             u8 flags (enum serve_flags), u8 reserved,
+ *             the code bytes, or a file path for SERVE_FILE
+ *   response  u32 length, then length bytes:
+ *             u8 status (0 ok), 3 reserved, the output text or an error
+ *
+ * Lengths are little-endian. --connect PATH is the client side.
+ *
+ * POSIX only, on Windows --serve and --connect just say so.
+ */
+
+#define SERVE_MAX_REQUEST (16u << 20)
+#define SERVE_WORKER_ARENA_SIZE (256ull << 20)
+
+enum serve_type
+{
+    SERVE_BYTES,
+    SERVE_FILE,
+    SERVE_SHUTDOWN,
+};
+
+enum serve_flags
+{
+    SERVE_LISTING    = 1 << 0,
+    SERVE_MEM_WRITES = 1 << 1,
+};
+
+static void
+serve_put_u32 (u8 *p, u32 value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = (u8) (value >> (i * 8));
+    }
+}
+
+static u32
+serve_get_u32 (u8 *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32) p[3] << 24);
+}
+
+#ifndef _WIN32
+
+struct server
+{
+    int fd;
+    int wake[2];          // self-pipe, readable once the server is stopping
+    volatile u32 stop;
+    struct arena *arenas; // one per worker
+};
+
+static bool
+serve_send_all (int fd, void *buf, u64 len)
+{
+    u8 *p = buf;
+
+    while (len)
+    {
+        ssize_t n = send (fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+
+        p += n;
+        len -= (u64) n;
+    }
+
+    return true;
+}
+
+/* false on errors and on the connection closing before len bytes */
+static bool
+serve_recv_all (int fd, void *buf, u64 len)
+{
+    u8 *p = buf;
+
+    while (len)
+    {
+        ssize_t n = recv (fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+
+        p += n;
+        len -= (u64) n;
+    }
+
+    return true;
+}
+
+/* blocks until fd is readable, false once the server is stopping */
+static bool
+serve_wait (struct server *server, int fd)
+{
+    struct pollfd fds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = server->wake[0], .events = POLLIN },
+    };
+
+    while (!atomic_load_u32 (&server->stop))
+    {
+        int n = poll (fds, 2, -1);
+        if (n < 0 && errno != EINTR)
+        {
+            return false;
+        }
+        if (n > 0)
+        {
+            return !fds[1].revents && fds[0].revents;
+        }
+    }
+
+    return false;
+}
+
+/* handles one request, writing its output to fp. Returns the status */
+static u8
+serve_handle (struct server *server, struct arena *arena, u8 *request, u32 len)
+{
+    if (len < 4)
+    {
+        fprintf (fp, "Error: short request\n");
+        return 1;
+    }
+
+    u8 type = request[0];
+    u8 syntax = request[1];
+    u8 flags = request[2];
+    u8 *data = &request[4];
+    u32 data_len = len - 4;
+
+    if (type == SERVE_SHUTDOWN)
+    {
+        atomic_store_u32 (&server->stop, 1);
+        if (write (server->wake[1], "", 1) < 0)
+        {
+            // the flag alone still stops workers between requests
+        }
+        return 0;
+    }
+    if (syntax >= ARRAY_COUNT (formats))
+    {
+        fprintf (fp, "Error: unknown syntax %u\n", syntax);
+        return 1;
+    }
+
+    format = &formats[syntax];
+    format_listing = (flags & SERVE_LISTING) != 0;
+    if (format_listing && format->has_offset)
+    {
+        fprintf (fp, "Error: --listing is for the text syntaxes\n");
+        return 1;
+    }
+
+    if (type == SERVE_FILE)
+    {
+        char *path = (char *) data; // the request is zero padded
+        char *error = NULL;
+
+        data = read_file (arena, path, SERVE_MAX_REQUEST, 1, &data_len, &error);
+        if (!data)
+        {
+            fprintf (fp, "Error: Could not read '%s': %s\n", path, error);
+            return 1;
+        }
+    }
+    else if (type != SERVE_BYTES)
+    {
+        fprintf (fp, "Error: unknown request type %u\n", type);
+        return 1;
+    }
+
+    if (flags & SERVE_MEM_WRITES)
+    {
+        struct inst_batch batch = batch_decode (arena, data, (int) data_len, NULL);
+        batch_print_memory_writes (arena, &batch);
+    }
+    else
+    {
+        decode (data, (int) data_len);
+    }
+
+    return 0;
+}
+
+/* answers requests until the client closes the connection */
+static void
+serve_connection (struct server *server, struct arena *arena, int client)
+{
+    u8 header[4];
+
+    while (serve_wait (server, client) && serve_recv_all (client, header, sizeof (header)))
+    {
+        struct arena_mark mark = arena_mark (arena);
+        u32 len = serve_get_u32 (header);
+        char *text = NULL;
+        size_t text_len = 0;
+        u8 status = 1;
+
+        fp = open_memstream (&text, &text_len);
+        if (!fp)
+        {
+            break;
+        }
+
+        if (len > SERVE_MAX_REQUEST)
+        {
+            fprintf (fp, "Error: request of %u bytes is over the %u byte limit\n", len, SERVE_MAX_REQUEST);
+        }
+        else
+        {
+            u8 *request = arena_push (arena, (u64) len + 16); // zero padded for decoding
+            if (!serve_recv_all (client, request, len))
+            {
+                fclose (fp);
+                free (text);
+                arena_pop_to (mark);
+                break;
+            }
+
+            status = serve_handle (server, arena, request, len);
+        }
+
+        fclose (fp);
+        fp = NULL;
+
+        u8 response[8] = {0};
+        serve_put_u32 (response, (u32) text_len + 4);
+        response[4] = status;
+
+        bool sent = serve_send_all (client, response, sizeof (response)) &&
+                    serve_send_all (client, text, text_len);
+        free (text);
+        arena_pop_to (mark);
+
+        if (!sent || len > SERVE_MAX_REQUEST)
+        {
+            break;
+        }
+    }
+}
+
+static void
+serve_worker (void *context, u32 worker, u32 index)
+{
+    struct server *server = context;
+    struct arena *arena = &server->arenas[worker];
+
+    output_set_buffer (arena_push_nozero (arena, OUTPUT_BUFFER_SIZE), OUTPUT_BUFFER_SIZE);
+
+    while (serve_wait (server, server->fd))
+    {
+        // the socket is non-blocking, another worker may have taken the connection
+        int client = accept (server->fd, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                continue;
+            }
+            break;
+        }
+
+        // some systems pass O_NONBLOCK on to the accepted socket
+        fcntl (client, F_SETFL, fcntl (client, F_GETFL) & ~O_NONBLOCK);
+        serve_connection (server, arena, client);
+        close (client);
+    }
+}
+
+static int
+serve_run (struct arena *arena, char *path, u32 thread_count)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct server server = { .wake = { -1, -1 } };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    u32 worker_count = pool_worker_count (thread_count);
+
+    if (strlen (path) >= sizeof (addr.sun_path))
+    {
+        fprintf (stderr, "Error: socket path '%s' is too long\n", path);
+        return 1;
+    }
+    strcpy (addr.sun_path, path);
+
+    signal (SIGPIPE, SIG_IGN); // a client going away is a failed send, not the end of the server
+
+    // a socket left behind by a previous server
+    if (stat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+    {
+        unlink (path);
+    }
+
+    server.fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (server.fd < 0 ||
+        fcntl (server.fd, F_SETFL, O_NONBLOCK) != 0 ||
+        bind (server.fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 ||
+        listen (server.fd, 64) != 0 ||
+        pipe (server.wake) != 0)
+    {
+        fprintf (stderr, "Error: Could not listen on '%s': %s\n", path, strerror (errno));
+        if (server.fd >= 0)
+        {
+            close (server.fd);
+        }
+        return 1;
+    }
+
+    server.arenas = arena_push_array (arena, struct arena, worker_count);
+    for (u32 w = 0; w < worker_count; w++)
+    {
+        if (!arena_init (&server.arenas[w], SERVE_WORKER_ARENA_SIZE))
+        {
+            fprintf (stderr, "Error: Could not reserve memory\n");
+            for (u32 i = 0; i < w; i++)
+            {
+                arena_release (&server.arenas[i]);
+            }
+            arena_pop_to (mark);
+            close (server.wake[0]);
+            close (server.wake[1]);
+            close (server.fd);
+            unlink (path);
+            return 1;
+        }
+    }
+
+    fprintf (stderr, "serve: listening on %s, %u workers\n", path, worker_count);
+
+    // one task per worker, each runs until the server is shut down
+    pool_run (arena, worker_count, worker_count, serve_worker, &server);
+
+    close (server.wake[0]);
+    close (server.wake[1]);
+    close (server.fd);
+    unlink (path);
+    for (u32 w = 0; w < worker_count; w++)
+    {
+        arena_release (&server.arenas[w]);
+    }
+    arena_pop_to (mark);
+
+    fprintf (stderr, "serve: stopped\n");
+
+    return 0;
+}
+
+/* sends each input (its bytes, or its path with send_path) and prints the
+ * replies, or just asks the server to stop */
+static int
+serve_connect (struct arena *arena, char *path, char **inputs, u32 count,
+               u8 flags, bool send_path, bool stop)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int ret = 0;
+
+    if (strlen (path) >= sizeof (addr.sun_path))
+    {
+        fprintf (stderr, "Error: socket path '%s' is too long\n", path);
+        return 1;
+    }
+    strcpy (addr.sun_path, path);
+
+    signal (SIGPIPE, SIG_IGN);
+
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+    {
+        fprintf (stderr, "Error: Could not connect to '%s': %s\n", path, strerror (errno));
+        if (fd >= 0)
+        {
+            close (fd);
+        }
+        return 1;
+    }
+
+    u64 start = time_now_ns ();
+    u32 requests = stop ? 1 : count;
+
+    for (u32 i = 0; i < requests && ret == 0; i++)
+    {
+        struct arena_mark mark = arena_mark (arena);
+        u8 header[8] = {0};
+        u8 *payload = NULL;
+        u32 payload_len = 0;
+
+        header[4] = stop ? SERVE_SHUTDOWN : (send_path ? SERVE_FILE : SERVE_BYTES);
+        header[5] = (u8) (format - formats);
+        header[6] = flags;
+
+        if (stop)
+        {
+            // nothing but the header
+        }
+        else if (send_path)
+        {
+            payload = (u8 *) inputs[i];
+            payload_len = (u32) strlen (inputs[i]);
+        }
+        else
+        {
+            char *error = NULL;
+
+            payload = read_file (arena, inputs[i], SERVE_MAX_REQUEST, 1, &payload_len, &error);
+            if (!payload)
+            {
+                fprintf (stderr, "Error: Could not read '%s': %s\n", inputs[i], error);
+                ret = 1;
+                break;
+            }
+        }
+        serve_put_u32 (header, payload_len + 4);
+
+        u8 response[8];
+        if (!serve_send_all (fd, header, sizeof (header)) ||
+            !serve_send_all (fd, payload, payload_len) ||
+            !serve_recv_all (fd, response, sizeof (response)))
+        {
+            fprintf (stderr, "Error: lost the connection to '%s'\n", path);
+            ret = 1;
+            break;
+        }
+
+        // the length covers the status word, anything shorter is a broken reply
+        u32 reply_len = serve_get_u32 (response);
+        if (reply_len < 4 || !arena_fits (arena, reply_len))
+        {
+            fprintf (stderr, "Error: bad reply from '%s', length %u\n", path, reply_len);
+            ret = 1;
+            break;
+        }
+
+        u32 text_len = reply_len - 4;
+        u8 *text = arena_push_nozero (arena, text_len);
+        if (!serve_recv_all (fd, text, text_len))
+        {
+            fprintf (stderr, "Error: lost the connection to '%s'\n", path);
+            ret = 1;
+            break;
+        }
+
+        fwrite (text, 1, text_len, response[4] == 0 ? fp : stderr);
+        ret = response[4] != 0;
+
+        arena_pop_to (mark);
+    }
+
+    close (fd);
+
+    double seconds = (double) (time_now_ns () - start) / 1e9;
+    if (!stop && requests)
+    {
+        fprintf (stderr, "connect: %u requests, %.3fs (%.1f us/request)\n",
+                 requests, seconds, seconds * 1e6 / requests);
+    }
+
+    return ret;
+}
+
+#else
+
+static int
+serve_run (struct arena *arena, char *path, u32 thread_count)
+{
+    fprintf (stderr, "Error: --serve uses Unix domain sockets, it isn't supported on Windows\n");
+    return 1;
+}
+
+static int
+serve_connect (struct arena *arena, char *path, char **inputs, u32 count,
+               u8 flags, bool send_path, bool stop)
+{
+    fprintf (stderr, "Error: --connect uses Unix domain sockets, it isn't supported on Windows\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,481 @@
+/**
+ * Decoder conformance sweep
+ *
+ * Enumerates every opcode x ModRM combination, with a handful of
+ * displacement and immediate values for each (the edges of the signed
+ * and unsigned ranges), and checks the decoder against an independent
+ * reference of the 8086 encodings below. Every instruction must also
+ * re-encode to the bytes it was decoded from.
+ *
+ * Opcodes the reference doesn't list must be rejected by the decoder.
+ *
+ * The work is split into (opcode, ModRM) pairs and run on the
+ * thread pool.
+ */
+
+#define REFERENCE_ANY_EXT 0xFF
+
+struct reference_form
+{
+    u8 mask;
+    u8 value;
+    u8 ext; // required REG field of the ModRM byte (or REFERENCE_ANY_EXT)
+    enum op_type op;
+    enum encoding encoding;
+};
+
+/* from the 8086 family user's manual, table 4-12 */
+static struct reference_form reference_forms[] = {
+    { 0b11111100, 0b10001000, REFERENCE_ANY_EXT, OP_MOV, ENC_RM_REG  },
+    { 0b11111110, 0b11000110, 0b000,             OP_MOV, ENC_IMM_RM  },
+    { 0b11110000, 0b10110000, REFERENCE_ANY_EXT, OP_MOV, ENC_IMM_REG },
+
+    { 0b11111100, 0b00000000, REFERENCE_ANY_EXT, OP_ADD, ENC_RM_REG  },
+    { 0b11111100, 0b10000000, 0b000,             OP_ADD, ENC_IMM_RM  },
+    { 0b11111110, 0b00000100, REFERENCE_ANY_EXT, OP_ADD, ENC_IMM_ACC },
+
+    { 0b11111100, 0b00101000, REFERENCE_ANY_EXT, OP_SUB, ENC_RM_REG  },
+    { 0b11111100, 0b10000000, 0b101,             OP_SUB, ENC_IMM_RM  },
+    { 0b11111110, 0b00101100, REFERENCE_ANY_EXT, OP_SUB, ENC_IMM_ACC },
+
+    { 0b11111100, 0b00111000, REFERENCE_ANY_EXT, OP_CMP, ENC_RM_REG  },
+    { 0b11111100, 0b10000000, 0b111,             OP_CMP, ENC_IMM_RM  },
+    { 0b11111110, 0b00111100, REFERENCE_ANY_EXT, OP_CMP, ENC_IMM_ACC },
+};
+
+static char *reference_registers[2][8] = {
+    { "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh" },
+    { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di" },
+};
+
+static char *reference_eac[8] = {
+    "bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx",
+};
+
+static u16 sweep_values_8[]  = { 0x00, 0x01, 0x7F, 0x80, 0xFB, 0xFF };
+static u16 sweep_values_16[] = { 0x0000, 0x0001, 0x007F, 0x0080, 0x7FFF, 0x8000, 0xFFFB, 0x1234 };
+
+#define SWEEP_MAX_FAILURES 16
+
+struct expected_operand
+{
+    enum op_mode mode;
+    char *value;
+    u16 disp;
+    u16 data;
+};
+
+struct expected
+{
+    u8 len;
+    enum op_type op;
+    enum encoding encoding;
+    struct expected_operand operands[2];
+};
+
+struct sweep_failure
+{
+    u32 index; // position in the sweep, used to report failures in order
+    u8 bytes[8];
+    u8 len;
+    char reason[64];
+};
+
+struct sweep_worker
+{
+    u64 cases;
+    u32 failure_count;
+    struct sweep_failure failures[SWEEP_MAX_FAILURES];
+};
+
+static struct reference_form *
+reference_find (u8 b0, u8 b1)
+{
+    for (u32 i = 0; i < ARRAY_COUNT (reference_forms); i++)
+    {
+        struct reference_form *form = &reference_forms[i];
+
+        if ((b0 & form->mask) == form->value &&
+            (form->ext == REFERENCE_ANY_EXT || form->ext == ((b1 >> 3) & 0b111)))
+        {
+            return form;
+        }
+    }
+
+    return NULL;
+}
+
+static bool
+reference_has_modrm (struct reference_form *form)
+{
+    return form->encoding == ENC_RM_REG || form->encoding == ENC_IMM_RM;
+}
+
+/* builds the r/m side of a ModRM instruction, returns the displacement size */
+static u8
+reference_rm_operand (struct expected_operand *op, u8 mod, u8 rm, u8 w, u16 disp)
+{
+    u8 disp_len = 0;
+
+    if (mod == 0b11)
+    {
+        op->mode = REGISTER;
+        op->value = reference_registers[w][rm];
+    }
+    else if (mod == 0b00 && rm == 0b110)
+    {
+        op->mode = DIRECT_ADDRESS;
+        op->disp = disp;
+        disp_len = 2;
+    }
+    else
+    {
+        op->mode = MEMORY;
+        op->value = reference_eac[rm];
+        if (mod == 0b01)
+        {
+            op->disp = (u16) (s16) (s8) disp; // sign-extended
+            disp_len = 1;
+        }
+        else if (mod == 0b10)
+        {
+            op->disp = disp;
+            disp_len = 2;
+        }
+    }
+
+    return disp_len;
+}
+
+static void
+reference_expect (struct reference_form *form, u8 b0, u8 b1, u16 disp, u16 data, struct expected *e)
+{
+    *e = (struct expected) { .op = form->op, .encoding = form->encoding };
+
+    u8 mod = b1 >> 6;
+    u8 reg = (b1 >> 3) & 0b111;
+    u8 rm = b1 & 0b111;
+    struct expected_operand *dst = &e->operands[0];
+    struct expected_operand *src = &e->operands[1];
+
+    switch (form->encoding)
+    {
+        case ENC_RM_REG:
+        {
+            u8 d = (b0 >> 1) & 1;
+            u8 w = b0 & 1;
+            struct expected_operand *reg_op = d ? dst : src;
+            struct expected_operand *rm_op = d ? src : dst;
+
+            reg_op->mode = REGISTER;
+            reg_op->value = reference_registers[w][reg];
+            e->len = 2 + reference_rm_operand (rm_op, mod, rm, w, disp);
+        } break;
+        case ENC_IMM_RM:
+        {
+            u8 s = (form->op == OP_MOV) ? 0 : (b0 >> 1) & 1;
+            u8 w = b0 & 1;
+
+            e->len = 2 + reference_rm_operand (dst, mod, rm, w, disp);
+            src->mode = IMMEDIATE;
+            if (w && !s)
+            {
+                src->data = data;
+                e->len += 2;
+            }
+            else
+            {
+                src->data = (w && s) ? (u16) (s16) (s8) data : (u8) data;
+                e->len += 1;
+            }
+        } break;
+        case ENC_IMM_REG:
+        {
+            u8 w = (b0 >> 3) & 1;
+
+            dst->mode = REGISTER;
+            dst->value = reference_registers[w][b0 & 0b111];
+            src->mode = IMMEDIATE;
+            src->data = w ? data : (u8) data;
+            e->len = 1 + (w ? 2 : 1);
+        } break;
+        case ENC_IMM_ACC:
+        {
+            u8 w = b0 & 1;
+
+            dst->mode = REGISTER;
+            dst->value = reference_registers[w][0];
+            src->mode = IMMEDIATE;
+            src->data = w ? data : (u8) data;
+            e->len = 1 + (w ? 2 : 1);
+        } break;
+        case ENC_NONE:
+        {
+        } break;
+    }
+}
+
+/* returns NULL if the decoded record matches, otherwise what was wrong */
+static char *
+reference_check (struct expected *e, struct instruction *inst, u8 len)
+{
+    if (len != e->len)
+    {
+        return "length";
+    }
+    if (inst->op != e->op || inst->encoding != e->encoding)
+    {
+        return "op";
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        struct expected_operand *want = &e->operands[i];
+        struct operand *got = &inst->operands[i];
+
+        if (got->mode != want->mode)
+        {
+            return i ? "src mode" : "dst mode";
+        }
+
+        switch (want->mode)
+        {
+            case REGISTER:
+            case MEMORY:
+            {
+                if (!got->value || strcmp (got->value, want->value) != 0)
+                {
+                    return i ? "src register" : "dst register";
+                }
+                if (want->mode == MEMORY && got->disp != want->disp)
+                {
+                    return "displacement";
+                }
+            } break;
+            case DIRECT_ADDRESS:
+            {
+                if (got->direct_address != want->disp)
+                {
+                    return "direct address";
+                }
+            } break;
+            case IMMEDIATE:
+            {
+                if (got->data != want->data)
+                {
+                    return "immediate";
+                }
+            } break;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+sweep_fail (struct sweep_worker *worker, u32 index, u8 *bytes, u8 len, char *reason)
+{
+    if (worker->failure_count < SWEEP_MAX_FAILURES)
+    {
+        struct sweep_failure *failure = &worker->failures[worker->failure_count];
+
+        failure->index = index;
+        failure->len = len;
+        memcpy (failure->bytes, bytes, sizeof (failure->bytes));
+        snprintf (failure->reason, sizeof (failure->reason), "%s", reason);
+    }
+
+    worker->failure_count++;
+}
+
+static void
+sweep_case (struct sweep_worker *worker, u32 index, u8 *bytes, struct reference_form *form, u16 disp, u16 data)
+{
+    struct instruction inst;
+    struct expected e;
+    u8 encoded[16];
+
+    u8 len = decode_instruction (bytes, &inst);
+    worker->cases++;
+
+    if (!form)
+    {
+        if (len != 0)
+        {
+            sweep_fail (worker, index, bytes, 2, "decoded an invalid opcode");
+        }
+        return;
+    }
+
+    reference_expect (form, bytes[0], bytes[1], disp, data, &e);
+
+    char *reason = (len == 0) ? "not decoded" : reference_check (&e, &inst, len);
+    if (!reason && (encode_instruction (encoded, &inst) != len || memcmp (encoded, bytes, len) != 0))
+    {
+        reason = "re-encoding differs";
+    }
+
+    if (reason)
+    {
+        sweep_fail (worker, index, bytes, e.len, reason);
+    }
+}
+
+/* one (opcode, ModRM) pair, across all sampled displacement/immediate values */
+static void
+sweep_unit (struct sweep_worker *worker, u32 unit)
+{
+    u8 b0 = unit >> 8;
+    u8 b1 = unit & 0xFF;
+    struct reference_form *form = reference_find (b0, b1);
+    u8 bytes[8] = { b0, b1 };
+
+    if (form && !reference_has_modrm (form))
+    {
+        // the second byte is immediate data, so only sweep it once
+        if (b1 != 0)
+        {
+            return;
+        }
+
+        for (u32 d = 0; d < ARRAY_COUNT (sweep_values_16); d++)
+        {
+            u16 data = sweep_values_16[d];
+
+            memset (bytes, 0, sizeof (bytes));
+            bytes[0] = b0;
+            bytes[1] = data & 0xFF;
+            bytes[2] = data >> 8;
+            sweep_case (worker, unit, bytes, form, 0, data);
+        }
+        return;
+    }
+
+    if (!form)
+    {
+        sweep_case (worker, unit, bytes, NULL, 0, 0);
+        return;
+    }
+
+    u8 mod = b1 >> 6;
+    u8 rm = b1 & 0b111;
+    u8 disp_len = (mod == 0b01) ? 1 : (mod == 0b10 || (mod == 0b00 && rm == 0b110)) ? 2 : 0;
+    u16 *disps = (disp_len == 1) ? sweep_values_8 : sweep_values_16;
+    u32 disp_count = (disp_len == 0) ? 1 : (disp_len == 1) ? ARRAY_COUNT (sweep_values_8) : ARRAY_COUNT (sweep_values_16);
+    bool has_data = form->encoding == ENC_IMM_RM;
+    bool wide_data = has_data && (b0 & 1) && (form->op == OP_MOV || !(b0 & 0b10));
+    u16 *datas = wide_data ? sweep_values_16 : sweep_values_8;
+    u32 data_count = !has_data ? 1 : wide_data ? ARRAY_COUNT (sweep_values_16) : ARRAY_COUNT (sweep_values_8);
+
+    for (u32 d = 0; d < disp_count; d++)
+    {
+        for (u32 v = 0; v < data_count; v++)
+        {
+            u16 disp = disp_len ? disps[d] : 0;
+            u16 data = has_data ? datas[v] : 0;
+            u8 i = 2;
+
+            memset (&bytes[2], 0, sizeof (bytes) - 2);
+            if (disp_len >= 1)
+            {
+                bytes[i++] = disp & 0xFF;
+            }
+            if (disp_len == 2)
+            {
+                bytes[i++] = disp >> 8;
+            }
+            if (has_data)
+            {
+                bytes[i++] = data & 0xFF;
+                if (wide_data)
+                {
+                    bytes[i++] = data >> 8;
+                }
+            }
+
+            sweep_case (worker, unit, bytes, form, disp, data);
+        }
+    }
+}
+
+static void
+sweep_task (void *context, u32 worker, u32 index)
+{
+    struct sweep_worker *workers = context;
+
+    sweep_unit (&workers[worker], index);
+}
+
+static int
+sweep_failure_compare (const void *a, const void *b)
+{
+    const struct sweep_failure *x = a;
+    const struct sweep_failure *y = b;
+
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static int
+sweep_run (struct arena *arena, u32 thread_count)
+{
+    struct arena_mark mark = arena_mark (arena);
+    u64 start = time_now_ns ();
+    u64 cases = 0;
+    u32 failure_count = 0;
+    u32 reported = 0;
+
+    thread_count = pool_worker_count (thread_count);
+
+    struct sweep_worker *workers = arena_push_array (arena, struct sweep_worker, thread_count);
+    struct sweep_failure *failures = arena_push_array (arena, struct sweep_failure, thread_count * SWEEP_MAX_FAILURES);
+
+    // one task per (opcode, ModRM) pair
+    pool_run (arena, thread_count, 0x10000, sweep_task, workers);
+
+    for (u32 t = 0; t < thread_count; t++)
+    {
+        struct sweep_worker *worker = &workers[t];
+        u32 n = worker->failure_count < SWEEP_MAX_FAILURES ? worker->failure_count : SWEEP_MAX_FAILURES;
+
+        memcpy (&failures[reported], worker->failures, n * sizeof (failures[0]));
+        reported += n;
+        cases += worker->cases;
+        failure_count += worker->failure_count;
+    }
+
+    qsort (failures, reported, sizeof (failures[0]), sweep_failure_compare);
+
+    FILE *out = fp;
+    fp = stderr;
+    for (u32 f = 0; f < reported && f < SWEEP_MAX_FAILURES; f++)
+    {
+        struct sweep_failure *failure = &failures[f];
+        struct instruction inst;
+
+        fprintf (stderr, "sweep: FAIL %-24s", failure->reason);
+        for (u8 b = 0; b < failure->len && b < sizeof (failure->bytes); b++)
+        {
+            fprintf (stderr, " %02x", failure->bytes[b]);
+        }
+        fprintf (stderr, "  ->  ");
+        if (decode_instruction (failure->bytes, &inst))
+        {
+            instruction_print (&inst);
+        }
+        else
+        {
+            fprintf (stderr, "(not decoded)\n");
+        }
+    }
+    fp = out;
+
+    double seconds = (double) (time_now_ns () - start) / 1e9;
+
+    printf ("sweep: %s, %llu cases, %u failures, %u threads, %.3fs\n",
+            failure_count ? "FAILED" : "OK", (unsigned long long) cases,
+            failure_count, thread_count, seconds);
+
+    arena_pop_to (mark);
+
+    return failure_count ? 1 : 0;
+}
@@ -2,7 +2,11 @@
 
 setlocal EnableDelayedExpansion
 
-call build.bat
+call build.bat %1
+
+main.exe --sweep
+main.exe --lanes-check
+main.exe --trace-check
 
 for %%f in (listing_*.asm) do (
     set fname=%%f
@@ -0,0 +1,809 @@
+/**
+ * Execution traces
+ *
+ * --trace records every step of a run in a compact binary file and
+ * --replay rebuilds the machine state after any step from it, without
+ * the program or the memory image.
+ *
+ * The file is a header, a stream of records and an index:
+ *
+ *   header    "T86T", u32 version, u32 snapshot interval
+ *   step      varint mask (TRACE_* bits)
+ *             varint ip delta, zigzag, from the ip after the previous step
+ *             u16 for every register in the mask (ax..di), then flags
+ *             varint address and 1 or 2 bytes, if TRACE_MEM
+ *   snapshot  varint TRACE_SNAPSHOT, u64 step, u16 regs[8] sregs[4] ip flags,
+ *             u16 page count, then u16 page number + 4KB for each page
+ *             written since the previous snapshot
+ *   end       varint TRACE_END
+ *   index     u32 count, then u64 step + u64 file offset for each snapshot
+ *   footer    u64 index offset, "T86I"
+ *
+ * Everything is little-endian. A typical step is 4-6 bytes. The first
+ * snapshot (step 0) holds the memory image, after that one is written
+ * every snapshot interval steps so replay only has to run forward from
+ * the closest one.
+ *
+ * Records are encoded on the executing thread into a single-producer
+ * single-consumer ring, a writer thread drains it to the file. The
+ * machine only waits on IO when the ring is full.
+ */
+
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE (1 << 20)
+#define TRACE_SNAPSHOT_INTERVAL 4096
+
+enum trace_mask
+{
+    TRACE_FLAGS    = 1 << 0,
+    TRACE_AX       = 1 << 1, // ax cx dx bx, the common ones fit in one byte
+    TRACE_MEM      = 1 << 5,
+    TRACE_MEM_WORD = 1 << 6,
+    TRACE_SNAPSHOT = 1 << 7,
+    TRACE_SP       = 1 << 8, // sp bp si di
+    TRACE_END      = 1 << 12,
+};
+
+static u32 trace_reg_bits[8] = {
+    TRACE_AX << 0, TRACE_AX << 1, TRACE_AX << 2, TRACE_AX << 3,
+    TRACE_SP << 0, TRACE_SP << 1, TRACE_SP << 2, TRACE_SP << 3,
+};
+
+struct trace_ring
+{
+    volatile u32 head; // free-running, written by the producer
+    u8 pad0[60];
+    volatile u32 tail; // free-running, written by the writer thread
+    u8 pad1[60];
+    volatile u32 done;
+    u8 *data;
+};
+
+struct tracer
+{
+    struct trace_ring ring;
+    u32 head;      // producer's copy of ring.head
+    u32 tail_seen; // last ring.tail the producer looked at
+    u64 written;   // bytes produced so far, the file offset of the next record
+
+    FILE *file;
+    struct thread thread;
+    bool io_error;
+
+    u32 snapshot_interval;
+    u32 snapshot_count;
+    u32 snapshot_capacity;
+    u64 *snapshot_steps;
+    u64 *snapshot_offsets;
+    u8 dirty[PAGE_COUNT]; // pages written since the last snapshot
+
+    // state as of the last record
+    u16 regs[8];
+    u16 ip;
+    u16 flags;
+};
+
+static u8 *
+trace_put_varint (u8 *p, u32 value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (u8) (value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (u8) value;
+
+    return p;
+}
+
+static u8 *
+trace_put_u16 (u8 *p, u16 value)
+{
+    p[0] = (u8) value;
+    p[1] = (u8) (value >> 8);
+
+    return p + 2;
+}
+
+static u8 *
+trace_put_u64 (u8 *p, u64 value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        p[i] = (u8) (value >> (i * 8));
+    }
+
+    return p + 8;
+}
+
+static void
+trace_writer (void *param)
+{
+    struct tracer *t = param;
+    struct trace_ring *ring = &t->ring;
+    u32 tail = ring->tail;
+
+    for (;;)
+    {
+        bool done = atomic_load_u32 (&ring->done) != 0;
+        u32 head = atomic_load_u32 (&ring->head);
+
+        if (head == tail)
+        {
+            if (done)
+            {
+                break;
+            }
+
+            thread_sleep_ms (1);
+            continue;
+        }
+
+        // up to the end of the ring, the rest on the next pass
+        u32 start = tail & (TRACE_RING_SIZE - 1);
+        u32 len = head - tail;
+        if (len > TRACE_RING_SIZE - start)
+        {
+            len = TRACE_RING_SIZE - start;
+        }
+
+        if (fwrite (&ring->data[start], 1, len, t->file) != len)
+        {
+            t->io_error = true;
+        }
+
+        tail += len;
+        atomic_store_u32 (&ring->tail, tail);
+    }
+}
+
+static void
+trace_put (struct tracer *t, u8 *bytes, u32 len)
+{
+    struct trace_ring *ring = &t->ring;
+
+    t->written += len;
+    while (len)
+    {
+        u32 space = TRACE_RING_SIZE - (t->head - t->tail_seen);
+        if (space == 0)
+        {
+            t->tail_seen = atomic_load_u32 (&ring->tail);
+            if (t->head - t->tail_seen == TRACE_RING_SIZE)
+            {
+                thread_yield ();
+            }
+            continue;
+        }
+
+        u32 start = t->head & (TRACE_RING_SIZE - 1);
+        u32 n = len;
+        if (n > space)                    n = space;
+        if (n > TRACE_RING_SIZE - start)  n = TRACE_RING_SIZE - start;
+
+        memcpy (&ring->data[start], bytes, n);
+        t->head += n;
+        bytes += n;
+        len -= n;
+        atomic_store_u32 (&ring->head, t->head);
+    }
+}
+
+static void
+trace_snapshot (struct tracer *t, struct machine *m)
+{
+    u8 buf[64];
+    u8 *p = buf;
+    u32 page_count = 0;
+
+    ASSERT (t->snapshot_count < t->snapshot_capacity);
+    t->snapshot_steps[t->snapshot_count] = m->steps;
+    t->snapshot_offsets[t->snapshot_count] = t->written;
+    t->snapshot_count++;
+
+    for (u32 page = 0; page < PAGE_COUNT; page++)
+    {
+        page_count += t->dirty[page];
+    }
+
+    p = trace_put_varint (p, TRACE_SNAPSHOT);
+    p = trace_put_u64 (p, m->steps);
+    for (int r = 0; r < 8; r++)
+    {
+        p = trace_put_u16 (p, m->regs[r]);
+    }
+    for (int s = 0; s < 4; s++)
+    {
+        p = trace_put_u16 (p, m->sregs[s]);
+    }
+    p = trace_put_u16 (p, m->ip);
+    p = trace_put_u16 (p, m->flags);
+    p = trace_put_u16 (p, (u16) page_count);
+    trace_put (t, buf, (u32) (p - buf));
+
+    for (u32 page = 0; page < PAGE_COUNT; page++)
+    {
+        if (t->dirty[page])
+        {
+            trace_put_u16 (buf, (u16) page);
+            trace_put (t, buf, 2);
+            trace_put (t, m->pages[page], PAGE_SIZE);
+            t->dirty[page] = 0;
+        }
+    }
+
+    memcpy (t->regs, m->regs, sizeof (t->regs));
+    t->ip = m->ip;
+    t->flags = m->flags;
+}
+
+/* after each step. addr is where the step wrote to memory, if it did */
+static void
+trace_step (struct tracer *t, struct machine *m, bool wrote, u32 addr, u8 w)
+{
+    u8 buf[64];
+    u8 *p = buf;
+    u32 mask = 0;
+    s32 ip_delta = (s16) (u16) (m->ip - t->ip);
+
+    for (int r = 0; r < 8; r++)
+    {
+        mask |= (m->regs[r] != t->regs[r]) ? trace_reg_bits[r] : 0;
+    }
+    mask |= (m->flags != t->flags) ? TRACE_FLAGS : 0;
+    if (wrote)
+    {
+        mask |= TRACE_MEM | (w ? TRACE_MEM_WORD : 0);
+    }
+
+    p = trace_put_varint (p, mask);
+    p = trace_put_varint (p, ((u32) ip_delta << 1) ^ (u32) (ip_delta >> 31));
+    for (int r = 0; r < 8; r++)
+    {
+        if (mask & trace_reg_bits[r])
+        {
+            p = trace_put_u16 (p, m->regs[r]);
+            t->regs[r] = m->regs[r];
+        }
+    }
+    if (mask & TRACE_FLAGS)
+    {
+        p = trace_put_u16 (p, m->flags);
+        t->flags = m->flags;
+    }
+    if (wrote)
+    {
+        addr &= MEMORY_SIZE - 1;
+        p = trace_put_varint (p, addr);
+        *p++ = mem_read8 (m, addr);
+        t->dirty[addr >> PAGE_SHIFT] = 1;
+        if (w)
+        {
+            u32 next = (addr + 1) & (MEMORY_SIZE - 1);
+            *p++ = mem_read8 (m, next);
+            t->dirty[next >> PAGE_SHIFT] = 1;
+        }
+    }
+    t->ip = m->ip;
+
+    trace_put (t, buf, (u32) (p - buf));
+}
+
+/* machine_run() with a record of every step */
+static bool
+trace_machine_run (struct machine *m, struct program *program, struct tracer *t)
+{
+    while (m->ip < program->len)
+    {
+        u32 n = program->index_at[m->ip];
+        if (n == PROGRAM_NO_INSTRUCTION)
+        {
+            return false;
+        }
+
+        struct instruction *inst = &program->insts[n];
+        struct operand *dst = &inst->operands[0];
+        bool wrote = (dst->mode == MEMORY || dst->mode == DIRECT_ADDRESS) && inst->op != OP_CMP;
+        u32 addr = wrote ? operand_address (m, dst) : 0;
+
+        m->ip += program->lens[n];
+        exec_instruction (m, inst);
+        m->steps++;
+
+        trace_step (t, m, wrote, addr, inst->w);
+        if (m->steps % t->snapshot_interval == 0)
+        {
+            trace_snapshot (t, m);
+        }
+    }
+
+    return true;
+}
+
+/* runs the program once on m, recording it to trace_file. m's pages
+ * stay on the arena for the caller to pop */
+static int
+trace_record (struct arena *arena, struct program *program, u8 *image, u32 image_len,
+              char *trace_file, u32 snapshot_interval, struct machine *m)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct tracer *t = arena_push (arena, sizeof (*t));
+    u8 buf[64];
+    u8 *p;
+    int ret = 0;
+
+    t->file = fopen (trace_file, "wb");
+    if (!t->file)
+    {
+        fprintf (stderr, "Error: Could not open '%s' for writing\n", trace_file);
+        arena_pop_to (mark);
+        return 1;
+    }
+
+    // every instruction runs at most once, ip only goes forward
+    t->snapshot_interval = snapshot_interval ? snapshot_interval : TRACE_SNAPSHOT_INTERVAL;
+    t->snapshot_capacity = program->count / t->snapshot_interval + 2;
+    t->snapshot_steps = arena_push_array (arena, u64, t->snapshot_capacity);
+    t->snapshot_offsets = arena_push_array (arena, u64, t->snapshot_capacity);
+    t->ring.data = arena_push_nozero (arena, TRACE_RING_SIZE);
+
+    if (!thread_start (&t->thread, trace_writer, t))
+    {
+        fprintf (stderr, "Error: Could not start the trace writer\n");
+        fclose (t->file);
+        arena_pop_to (mark);
+        return 1;
+    }
+
+    u64 start = time_now_ns ();
+
+    p = buf;
+    memcpy (p, "T86T", 4);
+    p += 4;
+    p[0] = TRACE_VERSION; p[1] = p[2] = p[3] = 0;
+    p += 4;
+    for (int i = 0; i < 4; i++)
+    {
+        *p++ = (u8) (t->snapshot_interval >> (i * 8));
+    }
+    trace_put (t, buf, (u32) (p - buf));
+
+    machine_init (m, arena, image, image_len);
+    for (u32 page = 0; page < image_len / PAGE_SIZE; page++)
+    {
+        t->dirty[page] = 1;
+    }
+    trace_snapshot (t, m);
+
+    if (!trace_machine_run (m, program, t))
+    {
+        fprintf (stderr, "Error: ip 0x%04x is not the start of an instruction\n", m->ip);
+        ret = 1;
+    }
+
+    p = trace_put_varint (buf, TRACE_END);
+    trace_put (t, buf, (u32) (p - buf));
+
+    u64 index_offset = t->written;
+    u32 count = t->snapshot_count;
+    u8 count_bytes[4] = { (u8) count, (u8) (count >> 8), (u8) (count >> 16), (u8) (count >> 24) };
+    trace_put (t, count_bytes, 4);
+    for (u32 i = 0; i < count; i++)
+    {
+        p = trace_put_u64 (buf, t->snapshot_steps[i]);
+        p = trace_put_u64 (p, t->snapshot_offsets[i]);
+        trace_put (t, buf, (u32) (p - buf));
+    }
+    p = trace_put_u64 (buf, index_offset);
+    memcpy (p, "T86I", 4);
+    trace_put (t, buf, 12);
+
+    u64 executed = time_now_ns ();
+    atomic_store_u32 (&t->ring.done, 1);
+    thread_join (&t->thread);
+
+    if (fclose (t->file) != 0 || t->io_error)
+    {
+        fprintf (stderr, "Error: Could not write '%s'\n", trace_file);
+        ret = 1;
+    }
+
+    u64 end = time_now_ns ();
+    fprintf (stderr, "trace: %llu steps, %llu bytes (%.2f bytes/step), %u snapshots, "
+             "%.3fs running, %.3fs total\n",
+             (unsigned long long) m->steps, (unsigned long long) t->written,
+             m->steps ? (double) t->written / (double) m->steps : 0.0, count,
+             (double) (executed - start) / 1e9, (double) (end - start) / 1e9);
+
+    return ret;
+}
+
+/* runs the program once, recording it to trace_file, and prints the
+ * final state */
+static int
+trace_run (struct arena *arena, struct program *program, u8 *image, u32 image_len,
+           char *trace_file, u32 snapshot_interval, u32 dump_addr, u32 dump_len)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct machine m = {0};
+    int ret = trace_record (arena, program, image, image_len, trace_file, snapshot_interval, &m);
+
+    // m.arena is only set once the run started
+    if (m.arena)
+    {
+        machine_print (fp, &m);
+        machine_dump_print (fp, &m, dump_addr, dump_len);
+    }
+
+    arena_pop_to (mark);
+
+    return ret;
+}
+
+/**
+ * Replay
+ */
+
+struct trace_reader
+{
+    FILE *file;
+    bool eof;
+};
+
+static u8
+trace_get_u8 (struct trace_reader *r)
+{
+    int c = fgetc (r->file);
+
+    if (c == EOF)
+    {
+        r->eof = true;
+        return 0;
+    }
+
+    return (u8) c;
+}
+
+static u32
+trace_get_varint (struct trace_reader *r)
+{
+    u32 value = 0;
+
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        u8 byte = trace_get_u8 (r);
+
+        value |= (u32) (byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            break;
+        }
+    }
+
+    return value;
+}
+
+static u16
+trace_get_u16 (struct trace_reader *r)
+{
+    u16 lo = trace_get_u8 (r);
+
+    return lo | (u16) (trace_get_u8 (r) << 8);
+}
+
+static u64
+trace_get_u64 (struct trace_reader *r)
+{
+    u64 value = 0;
+
+    for (int i = 0; i < 8; i++)
+    {
+        value |= (u64) trace_get_u8 (r) << (i * 8);
+    }
+
+    return value;
+}
+
+/* reads the snapshot record at the current position into m, the pages
+ * always and the registers if regs is set. Returns its step */
+static u64
+trace_read_snapshot (struct trace_reader *r, struct machine *m, bool regs)
+{
+    u16 values[14];
+
+    if (trace_get_varint (r) != TRACE_SNAPSHOT)
+    {
+        r->eof = true;
+        return 0;
+    }
+
+    u64 step = trace_get_u64 (r);
+    for (int i = 0; i < 14; i++)
+    {
+        values[i] = trace_get_u16 (r);
+    }
+    if (regs)
+    {
+        memcpy (m->regs, &values[0], sizeof (m->regs));
+        memcpy (m->sregs, &values[8], sizeof (m->sregs));
+        m->ip = values[12];
+        m->flags = values[13];
+        m->steps = step;
+    }
+
+    u16 page_count = trace_get_u16 (r);
+    for (u32 i = 0; i < page_count && !r->eof; i++)
+    {
+        u16 page = trace_get_u16 (r) % PAGE_COUNT;
+
+        if (!m->owned[page])
+        {
+            m->pages[page] = arena_push_nozero (m->arena, PAGE_SIZE);
+            m->owned[page] = 1;
+        }
+        if (fread (m->pages[page], 1, PAGE_SIZE, r->file) != PAGE_SIZE)
+        {
+            r->eof = true;
+        }
+    }
+
+    return step;
+}
+
+/* rebuilds the machine state after the given step (0 is the initial
+ * state) into m, its pages on the arena */
+static int
+trace_replay_to (struct arena *arena, char *trace_file, u64 step, struct machine *m)
+{
+    struct trace_reader r = { .file = fopen (trace_file, "rb") };
+    u8 magic[4] = {0};
+    int ret = 0;
+
+    if (!r.file)
+    {
+        fprintf (stderr, "Error: Could not open '%s'\n", trace_file);
+        return 1;
+    }
+
+    // footer, then the index it points at
+    fseek (r.file, 0, SEEK_END);
+    u64 file_len = (u64) ftell (r.file);
+    fseek (r.file, -12, SEEK_END);
+    u64 index_offset = trace_get_u64 (&r);
+    if (fread (magic, 1, 4, r.file) != 4 || memcmp (magic, "T86I", 4) != 0 || r.eof)
+    {
+        fprintf (stderr, "Error: '%s' is not a complete trace\n", trace_file);
+        fclose (r.file);
+        return 1;
+    }
+
+    // the count has to fill the index exactly, before we allocate for it
+    u64 index_len = (index_offset <= file_len - 12) ? file_len - 12 - index_offset : 0;
+    fseek (r.file, (long) index_offset, SEEK_SET);
+    u32 count = trace_get_u8 (&r);
+    for (int i = 1; i < 4; i++)
+    {
+        count |= (u32) trace_get_u8 (&r) << (i * 8);
+    }
+
+    if (count == 0 || r.eof || index_len < 4 || (u64) count * 16 != index_len - 4)
+    {
+        fprintf (stderr, "Error: '%s' has a broken index\n", trace_file);
+        fclose (r.file);
+        return 1;
+    }
+
+    u64 *steps = arena_push_array (arena, u64, count);
+    u64 *offsets = arena_push_array (arena, u64, count);
+    u32 nearest = 0;
+    bool broken = false;
+    for (u32 i = 0; i < count && !r.eof; i++)
+    {
+        steps[i] = trace_get_u64 (&r);
+        offsets[i] = trace_get_u64 (&r);
+        broken |= offsets[i] >= index_offset || (i > 0 && steps[i] < steps[i - 1]);
+        if (steps[i] <= step)
+        {
+            nearest = i;
+        }
+    }
+
+    if (broken || r.eof)
+    {
+        fprintf (stderr, "Error: '%s' has a broken index\n", trace_file);
+        fclose (r.file);
+        return 1;
+    }
+
+    // memory is every page from every snapshot up to the nearest one
+    machine_init (m, arena, NULL, 0);
+    for (u32 i = 0; i <= nearest; i++)
+    {
+        fseek (r.file, (long) offsets[i], SEEK_SET);
+        trace_read_snapshot (&r, m, i == nearest);
+    }
+
+    // then forward one step at a time
+    while (m->steps < step && !r.eof)
+    {
+        u32 mask = trace_get_varint (&r);
+        if (mask & (TRACE_END | TRACE_SNAPSHOT))
+        {
+            break;
+        }
+
+        u32 zigzag = trace_get_varint (&r);
+        m->ip += (u16) ((zigzag >> 1) ^ (0u - (zigzag & 1)));
+        for (int i = 0; i < 8; i++)
+        {
+            if (mask & trace_reg_bits[i])
+            {
+                m->regs[i] = trace_get_u16 (&r);
+            }
+        }
+        if (mask & TRACE_FLAGS)
+        {
+            m->flags = trace_get_u16 (&r);
+        }
+        if (mask & TRACE_MEM)
+        {
+            u32 addr = trace_get_varint (&r);
+
+            mem_write8 (m, addr, trace_get_u8 (&r));
+            if (mask & TRACE_MEM_WORD)
+            {
+                mem_write8 (m, addr + 1, trace_get_u8 (&r));
+            }
+        }
+        m->steps++;
+    }
+
+    if (r.eof)
+    {
+        fprintf (stderr, "Error: '%s' is truncated\n", trace_file);
+        ret = 1;
+    }
+    else if (m->steps < step)
+    {
+        fprintf (stderr, "Error: the trace ends after step %llu\n", (unsigned long long) m->steps);
+        ret = 1;
+    }
+
+    fclose (r.file);
+
+    return ret;
+}
+
+/* prints the machine state after the given step (0 is the initial state) */
+static int
+trace_replay (struct arena *arena, char *trace_file, u64 step, u32 dump_addr, u32 dump_len)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct machine m;
+    int ret = trace_replay_to (arena, trace_file, step, &m);
+
+    if (ret == 0)
+    {
+        fprintf (fp, "Step %llu:\n", (unsigned long long) m.steps);
+        machine_print (fp, &m);
+        machine_dump_print (fp, &m, dump_addr, dump_len);
+    }
+
+    arena_pop_to (mark);
+
+    return ret;
+}
+
+/**
+ * Replay self-check
+ *
+ * Records a generated program (over a random memory image) with a short
+ * snapshot interval, then steps a second machine through the same
+ * program and compares it with the replay after every 13th step, every
+ * snapshot boundary and the last step: registers, flags, ip and all of
+ * memory.
+ */
+
+#define TRACE_CHECK_BYTES    4096
+#define TRACE_CHECK_INTERVAL 64
+#define TRACE_CHECK_IMAGE    (16 * PAGE_SIZE)
+#define TRACE_CHECK_MAX_FAILURES 16
+
+static bool
+trace_check_same (struct machine *a, struct machine *b)
+{
+    bool same = memcmp (a->regs, b->regs, sizeof (a->regs)) == 0 &&
+                memcmp (a->sregs, b->sregs, sizeof (a->sregs)) == 0 &&
+                a->ip == b->ip && a->flags == b->flags && a->steps == b->steps;
+
+    for (u32 p = 0; p < PAGE_COUNT && same; p++)
+    {
+        same = a->pages[p] == b->pages[p] || memcmp (a->pages[p], b->pages[p], PAGE_SIZE) == 0;
+    }
+
+    return same;
+}
+
+static int
+trace_check_run (struct arena *arena, char *trace_file)
+{
+    struct arena_mark mark = arena_mark (arena);
+    struct bench_config config = bench_defaults;
+    struct machine recorded;
+    struct machine m;
+    struct program program;
+    u64 start = time_now_ns ();
+    u64 rng = 0x8086;
+    u32 checks = 0;
+    u32 failure_count = 0;
+
+    config.bytes = TRACE_CHECK_BYTES;
+    u8 *code = arena_push (arena, config.bytes + 16);
+    u32 len = gen_corpus (code, config.bytes, &config);
+    u8 *image = arena_push_nozero (arena, TRACE_CHECK_IMAGE);
+    for (u32 i = 0; i < TRACE_CHECK_IMAGE; i++)
+    {
+        image[i] = (u8) rng_next (&rng);
+    }
+
+    if (!program_load (arena, code, (int) len, &program) ||
+        trace_record (arena, &program, image, TRACE_CHECK_IMAGE, trace_file, TRACE_CHECK_INTERVAL, &recorded) != 0)
+    {
+        remove (trace_file);
+        arena_pop_to (mark);
+        return 1;
+    }
+
+    machine_init (&m, arena, image, TRACE_CHECK_IMAGE);
+    for (;;)
+    {
+        bool last = m.ip >= program.len;
+
+        if (m.steps % 13 == 0 || m.steps % TRACE_CHECK_INTERVAL == 0 || last)
+        {
+            struct arena_mark replay_mark = arena_mark (arena);
+            struct machine replayed;
+
+            checks++;
+            if (trace_replay_to (arena, trace_file, m.steps, &replayed) != 0 ||
+                !trace_check_same (&replayed, &m))
+            {
+                if (failure_count++ < TRACE_CHECK_MAX_FAILURES)
+                {
+                    fprintf (stderr, "trace: FAIL replay of step %llu differs from the run\n",
+                             (unsigned long long) m.steps);
+                }
+            }
+            arena_pop_to (replay_mark);
+        }
+
+        if (last)
+        {
+            break;
+        }
+
+        // machine_run() one step at a time, the generated code is all whole instructions
+        u32 n = program.index_at[m.ip];
+        m.ip += program.lens[n];
+        exec_instruction (&m, &program.insts[n]);
+        m.steps++;
+    }
+
+    if (!trace_check_same (&recorded, &m))
+    {
+        fprintf (stderr, "trace: FAIL the recorded run and the check run end differently\n");
+        failure_count++;
+    }
+
+    remove (trace_file);
+
+    double seconds = (double) (time_now_ns () - start) / 1e9;
+
+    printf ("trace: %s, %llu steps, %u replays checked, %u failures, %.3fs\n",
+            failure_count ? "FAILED" : "OK", (unsigned long long) m.steps, checks,
+            failure_count, seconds);
+
+    arena_pop_to (mark);
+
+    return failure_count ? 1 : 0;
+}